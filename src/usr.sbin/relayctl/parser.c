@@ -51,7 +51,8 @@ enum token_type {
 	TABLEID,
 	RDRID,
 	KEYWORD,
-	PATH
+	PATH,
+	WEIGHT
 };
 
 struct token {
@@ -69,6 +70,8 @@ static const struct token t_host[];
 static const struct token t_rdr_id[];
 static const struct token t_table_id[];
 static const struct token t_host_id[];
+static const struct token t_host_weight[];
+static const struct token t_weight[];
 static const struct token t_log[];
 static const struct token t_load[];
 
@@ -89,6 +92,7 @@ static const struct token t_main[] = {
 static const struct token t_show[] = {
 	{KEYWORD,	"summary",	SHOW_SUM,	NULL},
 	{KEYWORD,	"hosts",	SHOW_HOSTS,	NULL},
+	{KEYWORD,	"metrics",	SHOW_METRICS,	NULL},
 	{KEYWORD,	"redirects",	SHOW_RDRS,	NULL},
 	{KEYWORD,	"relays",	SHOW_RELAYS,	NULL},
 #ifndef __FreeBSD__
@@ -116,6 +120,7 @@ static const struct token t_host[] = {
 	{NOTOKEN,	"",		NONE,		NULL},
 	{KEYWORD,	"disable",	HOST_DISABLE,	t_host_id},
 	{KEYWORD,	"enable",	HOST_ENABLE,	t_host_id},
+	{KEYWORD,	"weight",	HOST_WEIGHT,	t_host_weight},
 	{ENDTOKEN,	"",		NONE,		NULL}
 };
 
@@ -134,6 +139,16 @@ static const struct token t_host_id[] = {
 	{ENDTOKEN,	"",		NONE,		NULL}
 };
 
+static const struct token t_host_weight[] = {
+	{HOSTID,	"",		NONE,		t_weight},
+	{ENDTOKEN,	"",		NONE,		NULL}
+};
+
+static const struct token t_weight[] = {
+	{WEIGHT,	"",		NONE,		NULL},
+	{ENDTOKEN,	"",		NONE,		NULL}
+};
+
 static const struct token t_log[] = {
 	{KEYWORD,	"verbose",	LOG_VERBOSE, 	NULL},
 	{KEYWORD,	"brief",	LOG_BRIEF, 	NULL},
@@ -242,6 +257,19 @@ match_token(const char *word, const struct token *table,
 			t = &table[i];
 			match++;
 			break;
+		case WEIGHT:
+			if (word == NULL)
+				break;
+			res->weight = strtonum(word, 1, RELAY_MAXWEIGHT,
+			    &errstr);
+			if (errstr) {
+				fprintf(stderr, "weight is %s: %s\n",
+				    errstr, word);
+				return (NULL);
+			}
+			t = &table[i];
+			match++;
+			break;
 		case PATH:
 			if (!match && word != NULL && strlen(word) > 0) {
 				res->path = strdup(word);
@@ -292,6 +320,9 @@ show_valid_args(const struct token *table)
 		case PATH:
 			fprintf(stderr, "  <path>\n");
 			break;
+		case WEIGHT:
+			fprintf(stderr, "  <weight>\n");
+			break;
 		case ENDTOKEN:
 			break;
 		}
@@ -23,6 +23,7 @@ enum actions {
 	SHOW_RDRS,
 	SHOW_RELAYS,
 	SHOW_SESSIONS,
+	SHOW_METRICS,
 #ifndef __FreeBSD__
 	SHOW_ROUTERS,
 #endif
@@ -32,6 +33,7 @@ enum actions {
 	TABLE_ENABLE,
 	HOST_DISABLE,
 	HOST_ENABLE,
+	HOST_WEIGHT,
 	SHUTDOWN,
 	POLL,
 	LOAD,
@@ -44,6 +46,7 @@ enum actions {
 struct parse_result {
 	struct ctl_id	id;
 	enum actions	action;
+	int		weight;
 	char		*path;
 };
 
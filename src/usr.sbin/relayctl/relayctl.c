@@ -51,12 +51,15 @@
 __dead void	 usage(void);
 int		 show_summary_msg(struct imsg *, int);
 int		 show_session_msg(struct imsg *);
+int		 show_metrics_msg(struct imsg *);
 int		 show_command_output(struct imsg *);
 char		*print_rdr_status(int);
 char		*print_host_status(int, int);
 char		*print_table_status(int, int);
 char		*print_relay_status(int);
 void		 print_statistics(struct ctl_stats[RELAY_MAXPROC + 1]);
+void		 print_latency(struct ctl_latency *);
+const char	*print_usec(u_int32_t, char *, size_t);
 
 struct imsgname {
 	int type;
@@ -77,6 +80,7 @@ struct imsgname imsgs[] = {
 	{ IMSG_CTL_TABLE_ENABLE,	"ctl_table_enable",	monitor_id },
 	{ IMSG_CTL_HOST_DISABLE,	"ctl_host_disable",	monitor_id },
 	{ IMSG_CTL_HOST_ENABLE,		"ctl_host_enable",	monitor_id },
+	{ IMSG_CTL_HOST_WEIGHT,		"ctl_host_weight",	monitor_id },
 	{ IMSG_CTL_TABLE_CHANGED,	"ctl_table_changed",	monitor_id },
 	{ IMSG_CTL_PULL_RULESET,	"ctl_pull_ruleset",	monitor_id },
 	{ IMSG_CTL_PUSH_RULESET,	"ctl_push_ruleset",	monitor_id },
@@ -105,6 +109,7 @@ main(int argc, char *argv[])
 	struct sockaddr_un	 sun;
 	struct parse_result	*res;
 	struct imsg		 imsg;
+	struct ctl_weight	 cw;
 	int			 ctl_sock;
 	int			 done = 0;
 	int			 n, verbose = 0;
@@ -155,6 +160,9 @@ main(int argc, char *argv[])
 	case SHOW_SESSIONS:
 		imsg_compose(ibuf, IMSG_CTL_SESSION, 0, 0, -1, NULL, 0);
 		break;
+	case SHOW_METRICS:
+		imsg_compose(ibuf, IMSG_CTL_METRICS, 0, 0, -1, NULL, 0);
+		break;
 	case RDR_ENABLE:
 		imsg_compose(ibuf, IMSG_CTL_RDR_ENABLE, 0, 0, -1,
 		    &res->id, sizeof(res->id));
@@ -179,6 +187,12 @@ main(int argc, char *argv[])
 		imsg_compose(ibuf, IMSG_CTL_HOST_DISABLE, 0, 0, -1,
 		    &res->id, sizeof(res->id));
 		break;
+	case HOST_WEIGHT:
+		bcopy(&res->id, &cw.id, sizeof(cw.id));
+		cw.weight = res->weight;
+		imsg_compose(ibuf, IMSG_CTL_HOST_WEIGHT, 0, 0, -1,
+		    &cw, sizeof(cw));
+		break;
 	case SHUTDOWN:
 		imsg_compose(ibuf, IMSG_CTL_SHUTDOWN, 0, 0, -1, NULL, 0);
 		break;
@@ -236,12 +250,16 @@ main(int argc, char *argv[])
 			case SHOW_SESSIONS:
 				done = show_session_msg(&imsg);
 				break;
+			case SHOW_METRICS:
+				done = show_metrics_msg(&imsg);
+				break;
 			case RDR_DISABLE:
 			case RDR_ENABLE:
 			case TABLE_DISABLE:
 			case TABLE_ENABLE:
 			case HOST_DISABLE:
 			case HOST_ENABLE:
+			case HOST_WEIGHT:
 			case POLL:
 			case SHUTDOWN:
 				done = show_command_output(&imsg);
@@ -341,6 +359,7 @@ show_summary_msg(struct imsg *imsg, int type)
 	struct netroute		*nr;
 #endif
 	struct ctl_stats	 stats[RELAY_MAXPROC];
+	struct ctl_latency	*cl;
 	char			 name[MAXHOSTNAMELEN];
 
 	switch (imsg->hdr.type) {
@@ -373,11 +392,23 @@ show_summary_msg(struct imsg *imsg, int type)
 		    host->conf.id, "host", name,
 		    print_availability(host->check_cnt, host->up_cnt),
 		    print_host_status(host->up, host->flags));
-		if (type == SHOW_HOSTS && host->check_cnt) {
+		if (type == SHOW_HOSTS &&
+		    (host->check_cnt || host->connfail_cnt ||
+		    host->session_cnt || host->eject_cnt ||
+		    host->conf.weight > 1)) {
 			printf("\t%8s\ttotal: %lu/%lu checks",
 			    "", host->up_cnt, host->check_cnt);
 			if (host->retry_cnt)
 				printf(", %d retries", host->retry_cnt);
+			if (host->session_cnt)
+				printf(", %lu sessions", host->session_cnt);
+			if (host->connfail_cnt)
+				printf(", %lu connect failures",
+				    host->connfail_cnt);
+			if (host->eject_cnt)
+				printf(", %lu ejections", host->eject_cnt);
+			if (host->conf.weight > 1)
+				printf(", weight %d", host->conf.weight);
 			if (host->he && host->up == HOST_DOWN)
 				printf(", error: %s", host_error(host->he));
 			printf("\n");
@@ -404,6 +435,12 @@ show_summary_msg(struct imsg *imsg, int type)
 		bcopy(imsg->data, &stats, sizeof(stats));
 		print_statistics(stats);
 		break;
+	case IMSG_CTL_LATENCY:
+		cl = imsg->data;
+		if ((cl->host && type == SHOW_HOSTS) ||
+		    (!cl->host && type == SHOW_RELAYS))
+			print_latency(cl);
+		break;
 #ifndef __FreeBSD__
 	case IMSG_CTL_ROUTER:
 		if (!(type == SHOW_SUM || type == SHOW_ROUTERS))
@@ -461,9 +498,17 @@ show_session_msg(struct imsg *imsg)
 		printf("\tage %s, idle %s, relay %u, pid %u",
 		    a, b, con->se_relayid, con->se_pid);
 		/* XXX grab tagname instead of tag id */
+		if (con->se_maxbuf)
+			printf(", buffered %lu", (u_long)con->se_maxbuf);
 		if (con->se_tag)
 			printf(", tag (id) %u", con->se_tag);
 		printf("\n");
+		printf("\tin %llu bytes, out %llu bytes",
+		    (unsigned long long)con->se_in.bytes,
+		    (unsigned long long)con->se_out.bytes);
+		if (con->se_in.requests)
+			printf(", %u requests", con->se_in.requests);
+		printf("\n");
 		break;
 	case IMSG_CTL_END:
 		return (1);
@@ -474,6 +519,23 @@ show_session_msg(struct imsg *imsg)
 	return (0);
 }
 
+int
+show_metrics_msg(struct imsg *imsg)
+{
+	switch (imsg->hdr.type) {
+	case IMSG_CTL_METRICS:
+		fwrite(imsg->data, imsg->hdr.len - IMSG_HEADER_SIZE, 1,
+		    stdout);
+		break;
+	case IMSG_CTL_END:
+		return (1);
+	default:
+		errx(1, "wrong message in metrics: %u", imsg->hdr.type);
+		break;
+	}
+	return (0);
+}
+
 int
 show_command_output(struct imsg *imsg)
 {
@@ -532,6 +594,8 @@ print_host_status(int status, int fl)
 	case HOST_UNKNOWN:
 		return ("unknown");
 	case HOST_UP:
+		if (fl & F_EJECTED)
+			return ("ejected");
 		return ("up");
 	default:
 		errx(1, "invalid status: %d", status);
@@ -558,27 +622,89 @@ print_statistics(struct ctl_stats stats[RELAY_MAXPROC + 1])
 	for (i = 0; stats[i].id != EMPTY_ID; i++) {
 		crs.cnt += stats[i].cnt;
 		crs.last += stats[i].last;
+		crs.last_sec += stats[i].last_sec;
 		crs.avg += stats[i].avg;
 		crs.last_hour += stats[i].last_hour;
 		crs.avg_hour += stats[i].avg_hour;
 		crs.last_day += stats[i].last_day;
 		crs.avg_day += stats[i].avg_day;
+		crs.overflows += stats[i].overflows;
+		crs.limited += stats[i].limited;
+		crs.rejects += stats[i].rejects;
+		crs.requests += stats[i].requests;
+		crs.bytes_in += stats[i].bytes_in;
+		crs.bytes_out += stats[i].bytes_out;
 	}
 	if (crs.cnt == 0)
 		return;
 	printf("\t%8s\ttotal: %llu sessions\n"
-	    "\t%8s\tlast: %u/%llus %u/h %u/d sessions\n"
+	    "\t%8s\tlast: %u/s %u/%llus %u/h %u/d sessions\n"
 	    "\t%8s\taverage: %u/%llus %u/h %u/d sessions\n",
 #ifndef __FreeBSD__
 	    "", crs.cnt,
-	    "", crs.last, crs.interval,
+	    "", crs.last_sec, crs.last, crs.interval,
 	    crs.last_hour, crs.last_day,
 	    "", crs.avg, crs.interval,
 #else
 	    "", (long long unsigned int)crs.cnt,
-	    "", crs.last, (long long unsigned int)crs.interval,
+	    "", crs.last_sec, crs.last, (long long unsigned int)crs.interval,
 	    crs.last_hour, crs.last_day,
 	    "", crs.avg, (long long unsigned int)crs.interval,
 #endif
 	    crs.avg_hour, crs.avg_day);
+	if (crs.overflows)
+		printf("\t%8s\taccept queue: %llu overflows\n",
+		    "", (unsigned long long)crs.overflows);
+	if (crs.limited || crs.rejects)
+		printf("\t%8s\tsession limit: %llu paused, %llu rejected\n",
+		    "", (unsigned long long)crs.limited,
+		    (unsigned long long)crs.rejects);
+	if (crs.bytes_in || crs.bytes_out)
+		printf("\t%8s\ttraffic: %llu bytes in, %llu bytes out\n",
+		    "", (unsigned long long)crs.bytes_in,
+		    (unsigned long long)crs.bytes_out);
+	if (crs.requests)
+		printf("\t%8s\trequests: %llu total\n",
+		    "", (unsigned long long)crs.requests);
+	if (i < 2)
+		return;
+	for (i = 0; stats[i].id != EMPTY_ID; i++) {
+		if (stats[i].accepts == 0)
+			continue;
+		printf("\t%8s\tinstance %d: %llu accepts\n",
+		    "", stats[i].proc, (unsigned long long)stats[i].accepts);
+	}
+}
+
+const char *
+print_usec(u_int32_t us, char *buf, size_t len)
+{
+	if (us < 1000)
+		snprintf(buf, len, "%uus", us);
+	else if (us < 1000000)
+		snprintf(buf, len, "%u.%02ums", us / 1000, us % 1000 / 10);
+	else
+		snprintf(buf, len, "%u.%02us", us / 1000000,
+		    us % 1000000 / 10000);
+	return (buf);
+}
+
+void
+print_latency(struct ctl_latency *cl)
+{
+	static const char	*names[LATENCY_MAX] = {
+		"accept", "connect", "response", "session"
+	};
+	char			 p[LATENCY_NPCT][16];
+	int			 type, i;
+
+	for (type = 0; type < LATENCY_MAX; type++) {
+		if (cl->cnt[type] == 0)
+			continue;
+		for (i = 0; i < LATENCY_NPCT; i++)
+			print_usec(cl->pct[type][i], p[i], sizeof(p[i]));
+		printf("\t%8s\t%s: %llu, p50 %s, p90 %s, p99 %s, p99.9 %s\n",
+		    "", names[type], (unsigned long long)cl->cnt[type],
+		    p[0], p[1], p[2], p[3]);
+	}
 }
@@ -82,6 +82,7 @@ ca_init(struct privsep *ps, struct privsep_proc *p, void *arg)
 	if (config_init(ps->ps_env) == -1)
 		fatal("failed to initialize configuration");
 
+	sslcache_unmap(ps->ps_env);
 	proc_id = p->p_instance;
 	env->sc_id = getpid() & 0xffff;
 }
@@ -67,6 +67,32 @@ config_init(struct relayd *env)
 		ps->ps_what[PROC_CA] = CONFIG_RELAYS;
 		ps->ps_what[PROC_RELAY] = CONFIG_RELAYS|
 		    CONFIG_TABLES|CONFIG_PROTOS|CONFIG_CA_ENGINE;
+	} else {
+		/*
+		 * Drop the configuration inherited from the parent,
+		 * the children receive their part of it by imsg.
+		 */
+		what = ps->ps_what[privsep_process];
+		ps->ps_what[privsep_process] = CONFIG_ALL;
+		config_purge(env, CONFIG_ALL);
+		ps->ps_what[privsep_process] = what;
+
+		free(env->sc_tables);
+		free(env->sc_rdrs);
+		free(env->sc_relays);
+		free(env->sc_pkeys);
+		free(env->sc_protos);
+		env->sc_tables = NULL;
+		env->sc_rdrs = NULL;
+		env->sc_relays = NULL;
+		env->sc_pkeys = NULL;
+		env->sc_protos = NULL;
+#ifndef __FreeBSD__
+		free(env->sc_rts);
+		free(env->sc_routes);
+		env->sc_rts = NULL;
+		env->sc_routes = NULL;
+#endif
 	}
 
 	/* Other configuration */
@@ -113,6 +139,7 @@ config_init(struct relayd *env)
 		env->sc_proto_default.cache = RELAY_CACHESIZE;
 		env->sc_proto_default.tcpflags = TCPFLAG_DEFAULT;
 		env->sc_proto_default.tcpbacklog = RELAY_BACKLOG;
+		env->sc_proto_default.tcpacceptbatch = RELAY_ACCEPTBATCH;
 		env->sc_proto_default.sslflags = SSLFLAG_DEFAULT;
 		(void)strlcpy(env->sc_proto_default.sslciphers,
 		    SSLCIPHERS_DEFAULT,
@@ -856,7 +883,16 @@ config_setrelay(struct relayd *env, struct relay *rlay)
 			n = -1;
 			proc_range(ps, id, &n, &m);
 			for (n = 0; n < m; n++) {
-				if ((fd = dup(rlay->rl_s)) == -1)
+				/*
+				 * Sharded relays give each instance but the
+				 * first its own SO_REUSEPORT listener.
+				 */
+				if (n > 0 && (rlay->rl_conf.flags &
+				    (F_REUSEPORT|F_UDP)) == F_REUSEPORT)
+					fd = relay_privinit_shard(rlay);
+				else
+					fd = dup(rlay->rl_s);
+				if (fd == -1)
 					return (-1);
 				proc_composev_imsg(ps, id, n,
 				    IMSG_CFG_RELAY, fd, iov, c);
@@ -960,6 +996,8 @@ config_getrelay(struct relayd *env, struct imsg *imsg)
 	}
 
 	TAILQ_INIT(&rlay->rl_tables);
+	TAILQ_INIT(&rlay->rl_sessions);
+	TAILQ_INIT(&rlay->rl_backends);
 	TAILQ_INSERT_TAIL(env->sc_relays, rlay, rl_entry);
 
 	env->sc_relaycount++;
@@ -989,7 +1027,9 @@ config_getrelaytable(struct relayd *env, struct imsg *imsg)
 	struct ctl_relaytable	 crt;
 	struct relay		*rlay;
 	struct table		*table;
+	struct host		*host;
 	u_int8_t		*p = imsg->data;
+	int			 n = 0;
 
 	IMSG_SIZE_CHECK(imsg, &crt);
 	memcpy(&crt, p, sizeof(crt));
@@ -1011,6 +1051,22 @@ config_getrelaytable(struct relayd *env, struct imsg *imsg)
 	rlt->rlt_mode = crt.mode;
 	rlt->rlt_flags = crt.flags;
 
+	/* Index the hosts for constant time selection */
+	TAILQ_FOREACH(host, &table->hosts, entry)
+		n++;
+	if (n > RELAY_MAXHOSTS)
+		fatalx("config_getrelaytable: too many hosts, desynchronized");
+	if (n > 0 &&
+	    ((rlt->rlt_host = calloc(n, sizeof(*rlt->rlt_host))) == NULL ||
+	    (rlt->rlt_weight = calloc(n, sizeof(*rlt->rlt_weight))) == NULL ||
+	    (rlt->rlt_up = calloc(n, sizeof(*rlt->rlt_up))) == NULL ||
+	    (rlt->rlt_uppos = calloc(n, sizeof(*rlt->rlt_uppos))) == NULL))
+		goto fail;
+	TAILQ_FOREACH(host, &table->hosts, entry) {
+		host->idx = rlt->rlt_nhosts;
+		rlt->rlt_host[rlt->rlt_nhosts++] = host;
+	}
+
 	TAILQ_INSERT_TAIL(&rlay->rl_tables, rlt, rlt_entry);
 
 	DPRINTF("%s: %s %d received relay table %s for relay %s", __func__,
@@ -1020,7 +1076,12 @@ config_getrelaytable(struct relayd *env, struct imsg *imsg)
 	return (0);
 
  fail:
-	if (rlt != NULL)
+	if (rlt != NULL) {
+		free(rlt->rlt_host);
+		free(rlt->rlt_weight);
+		free(rlt->rlt_up);
+		free(rlt->rlt_uppos);
 		free(rlt);
+	}
 	return (-1);
 }
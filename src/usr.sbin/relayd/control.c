@@ -229,6 +229,7 @@ control_dispatch_imsg(int fd, short event, void *arg)
 	struct ctl_conn		*c;
 	struct imsg		 imsg;
 	struct ctl_id		 id;
+	struct ctl_weight	 cw;
 	int			 n;
 	int			 verbose;
 	struct relayd		*env = cs->cs_env;
@@ -276,6 +277,9 @@ control_dispatch_imsg(int fd, short event, void *arg)
 		case IMSG_CTL_SESSION:
 			show_sessions(c);
 			break;
+		case IMSG_CTL_METRICS:
+			show_metrics(c);
+			break;
 		case IMSG_CTL_RDR_DISABLE:
 			if (imsg.hdr.len != IMSG_HEADER_SIZE + sizeof(id))
 				fatalx("invalid imsg header len");
@@ -360,6 +364,20 @@ control_dispatch_imsg(int fd, short event, void *arg)
 				    0, 0, -1, NULL, 0);
 			}
 			break;
+		case IMSG_CTL_HOST_WEIGHT:
+			if (imsg.hdr.len != IMSG_HEADER_SIZE + sizeof(cw))
+				fatalx("invalid imsg header len");
+			memcpy(&cw, imsg.data, sizeof(cw));
+			if (weight_host(c, &cw))
+				imsg_compose_event(&c->iev, IMSG_CTL_FAIL,
+				    0, 0, -1, NULL, 0);
+			else {
+				memcpy(imsg.data, &cw, sizeof(cw));
+				control_imsg_forward(&imsg);
+				imsg_compose_event(&c->iev, IMSG_CTL_OK,
+				    0, 0, -1, NULL, 0);
+			}
+			break;
 		case IMSG_CTL_SHUTDOWN:
 		case IMSG_CTL_RELOAD:
 			proc_forward_imsg(env->sc_ps, &imsg, PROC_PARENT, -1);
@@ -75,6 +75,7 @@ hce_init(struct privsep *ps, struct privsep_proc *p, void *arg)
 	if (config_init(ps->ps_env) == -1)
 		fatal("failed to initialize configuration");
 
+	sslcache_unmap(ps->ps_env);
 	env->sc_id = getpid() & 0xffff;
 
 	/* Allow maximum available sockets for TCP checks */
@@ -244,10 +245,20 @@ hce_notify_done(struct host *host, enum host_error he)
 		if (host->up == HOST_UP)
 			host->up_cnt++;
 	}
+	getmonotime(&tv_now);
+	timersub(&tv_now, &host->cte.tv_start, &tv_dur);
+	if (timercmp(&host->cte.tv_start, &tv_dur, >))
+		duration = (tv_dur.tv_sec * 1000) + (tv_dur.tv_usec / 1000.0);
+	else {
+		duration = 0;
+		timerclear(&tv_dur);
+	}
+
 	st.id = host->conf.id;
 	st.up = host->up;
 	st.check_cnt = host->check_cnt;
 	st.retry_cnt = host->retry_cnt;
+	st.duration = (u_int64_t)tv_dur.tv_sec * 1000000 + tv_dur.tv_usec;
 	st.he = he;
 	host->flags |= (F_CHECK_SENT|F_CHECK_DONE);
 	msg = host_error(he);
@@ -261,13 +272,6 @@ hce_notify_done(struct host *host, enum host_error he)
 	else
 		logopt = RELAYD_OPT_LOGNOTIFY;
 
-	getmonotime(&tv_now);
-	timersub(&tv_now, &host->cte.tv_start, &tv_dur);
-	if (timercmp(&host->cte.tv_start, &tv_dur, >))
-		duration = (tv_dur.tv_sec * 1000) + (tv_dur.tv_usec / 1000.0);
-	else
-		duration = 0;
-
 	if (env->sc_opts & logopt) {
 		log_info("host %s, check %s%s (%lums), state %s -> %s, "
 		    "availability %s",
@@ -192,6 +192,8 @@ DESTINATION PRIORITY ROUTER RTLABEL RTABLE MATCH
 %token	TRANSPARENT TRAP UPDATES URL VIRTUAL WITH TTL
 %token	PARAMS RANDOM LEASTSTATES SRCHASH KEY CERTIFICATE PASSWORD ECDH
 %token	EDH CURVE
+%token	ACCEPT REUSEPORT LIMIT KEEPALIVE FASTOPEN FILTER WEIGHT
+%token	LEASTLATENCY SLOWSTART EJECT BACKOFF
 %token	<v.string>	STRING
 %token  <v.number>	NUMBER
 %type	<v.string>	hostname interface table value optstring
@@ -200,7 +202,7 @@ DESTINATION PRIORITY ROUTER RTLABEL RTABLE MATCH
 %type	<v.number>	optssl optsslclient sslcache
 %type	<v.number>	redirect_proto relay_proto match
 %type	<v.number>	action ruleaf key_option
-%type	<v.number>	ssldhparams sslecdhcurve
+%type	<v.number>	ssldhparams sslecdhcurve ejectbackoff
 %type	<v.port>	port
 %type	<v.host>	host
 %type	<v.addr>	address
@@ -404,6 +406,15 @@ main		: INTERVAL NUMBER	{
 			}
 			conf->sc_prefork_relay = $2;
 		}
+		| SESSION LIMIT NUMBER	{
+			if (loadcfg)
+				break;
+			if ($3 <= 0 || $3 > INT_MAX) {
+				yyerror("invalid session limit: %lld", $3);
+				YYERROR;
+			}
+			conf->sc_maxsessions = $3;
+		}
 /* FreeBSD exclude
 		| SNMP trap optstring	{
 			if (loadcfg)
@@ -657,11 +668,21 @@ tabledef	: TABLE table		{
 			table = tb;
 			dstmode = RELAY_DSTMODE_DEFAULT;
 		} tabledefopts_l	{
+			struct host	*h;
+			int		 n = 0;
+
 			if (TAILQ_EMPTY(&table->hosts)) {
 				yyerror("table %s has no hosts",
 				    table->conf.name);
 				YYERROR;
 			}
+			TAILQ_FOREACH(h, &table->hosts, entry)
+				n++;
+			if (n > RELAY_MAXHOSTS) {
+				yyerror("table %s has more than %d hosts",
+				    table->conf.name, RELAY_MAXHOSTS);
+				YYERROR;
+			}
 			conf->sc_tablecount++;
 			TAILQ_INSERT_TAIL(conf->sc_tables, table, entry);
 		}
@@ -757,12 +778,37 @@ tableopts	: CHECK tablecheck
 			table->conf.skip_cnt =
 			    ($2 / conf->sc_interval.tv_sec) - 1;
 		}
+		| SLOWSTART NUMBER	{
+			if (rdr != NULL) {
+				yyerror("slow-start not supported "
+				    "for redirections");
+				YYERROR;
+			}
+			if ($2 <= 0 || $2 > INT_MAX) {
+				yyerror("invalid slow-start window: %lld", $2);
+				YYERROR;
+			}
+			table->conf.slowstart.tv_sec = $2;
+		}
+		| EJECT NUMBER ejectbackoff	{
+			if (rdr != NULL) {
+				yyerror("eject not supported for redirections");
+				YYERROR;
+			}
+			if ($2 <= 0 || $2 > INT_MAX) {
+				yyerror("invalid eject value: %lld", $2);
+				YYERROR;
+			}
+			table->conf.eject_errors = $2;
+			table->conf.eject_backoff.tv_sec = $3;
+		}
 		| MODE dstmode		{
 			switch ($2) {
 			case RELAY_DSTMODE_LOADBALANCE:
 			case RELAY_DSTMODE_HASH:
 			case RELAY_DSTMODE_SRCHASH:
 			case RELAY_DSTMODE_RANDOM:
+			case RELAY_DSTMODE_LEASTLATENCY:
 				if (rdr != NULL) {
 					yyerror("mode not supported "
 					    "for redirections");
@@ -770,14 +816,7 @@ tableopts	: CHECK tablecheck
 				}
 				/* FALLTHROUGH */
 			case RELAY_DSTMODE_ROUNDROBIN:
-				dstmode = $2;
-				break;
 			case RELAY_DSTMODE_LEASTSTATES:
-				if (rdr == NULL) {
-					yyerror("mode not supported "
-					    "for relays");
-					YYERROR;
-				}
 				dstmode = $2;
 				break;
 			}
@@ -931,6 +970,7 @@ proto		: relay_proto PROTO STRING	{
 			p->tcpflags = TCPFLAG_DEFAULT;
 			p->sslflags = SSLFLAG_DEFAULT;
 			p->tcpbacklog = RELAY_BACKLOG;
+			p->tcpacceptbatch = RELAY_ACCEPTBATCH;
 			TAILQ_INIT(&p->rules);
 			(void)strlcpy(p->sslciphers, SSLCIPHERS_DEFAULT,
 			    sizeof(p->sslciphers));
@@ -984,12 +1024,32 @@ tcpflags	: SACK			{ proto->tcpflags |= TCPFLAG_SACK; }
 		| SPLICE		{ /* default */ }
 		| NO SPLICE		{ proto->tcpflags |= TCPFLAG_NSPLICE; }
 		| BACKLOG NUMBER	{
-			if ($2 < 0 || $2 > RELAY_MAX_SESSIONS) {
+			if ($2 < 0 || $2 > RELAY_MAX_BACKLOG) {
 				yyerror("invalid backlog: %d", $2);
 				YYERROR;
 			}
 			proto->tcpbacklog = $2;
 		}
+		| ACCEPT NUMBER		{
+			if ($2 <= 0 || $2 > RELAY_MAX_BACKLOG) {
+				yyerror("invalid accept batch: %d", $2);
+				YYERROR;
+			}
+			proto->tcpacceptbatch = $2;
+		}
+		| ACCEPT FILTER STRING	{
+			if (strcmp($3, "dataready") != 0 &&
+			    strcmp($3, "httpready") != 0) {
+				yyerror("invalid accept filter: %s", $3);
+				free($3);
+				YYERROR;
+			}
+			(void)strlcpy(proto->tcpacceptfilter, $3,
+			    sizeof(proto->tcpacceptfilter));
+			free($3);
+			proto->tcpflags |= TCPFLAG_ACCEPTFILTER;
+		}
+		| FASTOPEN		{ proto->tcpflags |= TCPFLAG_FASTOPEN; }
 		| SOCKET BUFFER NUMBER	{
 			proto->tcpflags |= TCPFLAG_BUFSIZ;
 			if ((proto->tcpbufsiz = $3) < 0) {
@@ -1531,6 +1591,7 @@ relay		: RELAY STRING	{
 
 			if ((r = calloc(1, sizeof (*r))) == NULL)
 				fatal("out of memory");
+			r->rl_s = -1;
 
 			if (strlcpy(r->rl_conf.name, $2,
 			    sizeof(r->rl_conf.name)) >=
@@ -1547,6 +1608,10 @@ relay		: RELAY STRING	{
 				YYERROR;
 			}
 			r->rl_conf.timeout.tv_sec = RELAY_TIMEOUT;
+			r->rl_conf.keepalive_timeout.tv_sec =
+			    RELAY_KEEPALIVE_TIMEOUT;
+			r->rl_conf.bufhigh = RELAY_BUFLIMIT;
+			r->rl_conf.buflow = RELAY_BUFLIMIT / 2;
 			r->rl_proto = NULL;
 			r->rl_conf.proto = EMPTY_ID;
 			r->rl_conf.dstretry = 0;
@@ -1592,7 +1657,8 @@ relay		: RELAY STRING	{
 				YYERROR;
 			}
 			conf->sc_relaycount++;
-			SPLAY_INIT(&rlay->rl_sessions);
+			TAILQ_INIT(&rlay->rl_sessions);
+			TAILQ_INIT(&rlay->rl_backends);
 			TAILQ_INSERT_TAIL(conf->sc_relays, rlay, rl_entry);
 
 			tableport = 0;
@@ -1619,6 +1685,7 @@ relayoptsl	: LISTEN ON STRING port optssl {
 			if (rlay->rl_conf.ss.ss_family != AF_UNSPEC) {
 				if ((r = calloc(1, sizeof (*r))) == NULL)
 					fatal("out of memory");
+				r->rl_s = -1;
 				TAILQ_INSERT_TAIL(&relays, r, rl_entry);
 			} else
 				r = rlay;
@@ -1703,7 +1770,38 @@ relayoptsl	: LISTEN ON STRING port optssl {
 			rlay->rl_proto = p;
 			free($2);
 		}
+		| SESSION LIMIT NUMBER		{
+			if ($3 <= 0 || $3 > INT_MAX) {
+				yyerror("invalid session limit: %lld", $3);
+				YYERROR;
+			}
+			rlay->rl_conf.maxsessions = $3;
+		}
+		| KEEPALIVE NUMBER		{
+			if ($2 < 0 || $2 > RELAY_MAX_BACKLOG) {
+				yyerror("invalid keepalive pool size: %lld",
+				    $2);
+				YYERROR;
+			}
+			rlay->rl_conf.keepalive = $2;
+		}
+		| KEEPALIVE TIMEOUT NUMBER	{
+			if ($3 <= 0 || $3 > INT_MAX) {
+				yyerror("invalid keepalive timeout: %lld", $3);
+				YYERROR;
+			}
+			rlay->rl_conf.keepalive_timeout.tv_sec = $3;
+		}
+		| BUFFER LIMIT NUMBER		{
+			if ($3 <= 0 || $3 > INT_MAX) {
+				yyerror("invalid buffer limit: %lld", $3);
+				YYERROR;
+			}
+			rlay->rl_conf.bufhigh = $3;
+			rlay->rl_conf.buflow = $3 / 2;
+		}
 		| DISABLE		{ rlay->rl_conf.flags |= F_DISABLE; }
+		| REUSEPORT		{ rlay->rl_conf.flags |= F_REUSEPORT; }
 		| include
 		;
 
@@ -1773,6 +1871,7 @@ dstmode		: /* empty */		{ $$ = RELAY_DSTMODE_DEFAULT; }
 		| ROUNDROBIN		{ $$ = RELAY_DSTMODE_ROUNDROBIN; }
 		| HASH			{ $$ = RELAY_DSTMODE_HASH; }
 		| LEASTSTATES		{ $$ = RELAY_DSTMODE_LEASTSTATES; }
+		| LEASTLATENCY		{ $$ = RELAY_DSTMODE_LEASTLATENCY; }
 		| SRCHASH		{ $$ = RELAY_DSTMODE_SRCHASH; }
 		| RANDOM		{ $$ = RELAY_DSTMODE_RANDOM; }
 		;
@@ -1952,6 +2051,7 @@ host		: address	{
 			}
 			bcopy(&$1.ss, &hst->conf.ss, sizeof($1.ss));
 			hst->conf.id = 0; /* will be set later */
+			hst->conf.weight = 1;
 			SLIST_INIT(&hst->children);
 		} opthostflags {
 			$$ = hst;
@@ -2013,6 +2113,13 @@ hostflags	: RETRY NUMBER		{
 			}
 			hst->conf.ttl = $3;
 		}
+		| WEIGHT NUMBER		{
+			if ($2 < 1 || $2 > RELAY_MAXWEIGHT) {
+				yyerror("invalid weight value: %d\n", $2);
+				YYERROR;
+			}
+			hst->conf.weight = $2;
+		}
 		;
 
 address		: STRING	{
@@ -2039,6 +2146,16 @@ address		: STRING	{
 		}
 		;
 
+ejectbackoff	: /* empty */		{ $$ = RELAY_EJECT_BACKOFF; }
+		| BACKOFF NUMBER	{
+			if ($2 <= 0 || $2 > INT_MAX) {
+				yyerror("invalid backoff value: %lld", $2);
+				YYERROR;
+			}
+			$$ = $2;
+		}
+		;
+
 retry		: /* empty */		{ $$ = 0; }
 		| RETRY NUMBER		{
 			if (($$ = $2) < 0) {
@@ -2108,9 +2225,11 @@ lookup(char *s)
 {
 	/* this has to be sorted always */
 	static const struct keywords keywords[] = {
+		{ "accept",		ACCEPT },
 		{ "all",		ALL },
 		{ "append",		APPEND },
 		{ "backlog",		BACKLOG },
+		{ "backoff",		BACKOFF },
 		{ "backup",		BACKUP },
 		{ "block",		BLOCK },
 		{ "buffer",		BUFFER },
@@ -2130,10 +2249,13 @@ lookup(char *s)
 		{ "disable",		DISABLE },
 		{ "ecdh",		ECDH },
 		{ "edh",		EDH },
+		{ "eject",		EJECT },
 		{ "error",		ERROR },
 		{ "expect",		EXPECT },
 		{ "external",		EXTERNAL },
+		{ "fastopen",		FASTOPEN },
 		{ "file",		FILENAME },
+		{ "filter",		FILTER },
 		{ "forward",		FORWARD },
 		{ "from",		FROM },
 		{ "hash",		HASH },
@@ -2146,9 +2268,12 @@ lookup(char *s)
 		{ "interface",		INTERFACE },
 		{ "interval",		INTERVAL },
 		{ "ip",			IP },
+		{ "keepalive",		KEEPALIVE },
 		{ "key",		KEY },
 		{ "label",		LABEL },
+		{ "least-latency",	LEASTLATENCY },
 		{ "least-states",	LEASTSTATES },
+		{ "limit",		LIMIT },
 		{ "listen",		LISTEN },
 		{ "loadbalance",	LOADBALANCE },
 		{ "log",		LOG },
@@ -2182,6 +2307,7 @@ lookup(char *s)
 		{ "response",		RESPONSE },
 		{ "retry",		RETRY },
 		{ "return",		RETURN },
+		{ "reuseport",		REUSEPORT },
 		{ "roundrobin",		ROUNDROBIN },
 		{ "route",		ROUTE },
 /* FreeBSD exclude
@@ -2194,6 +2320,7 @@ lookup(char *s)
 		{ "send",		SEND },
 		{ "session",		SESSION },
 		{ "set",		SET },
+		{ "slow-start",		SLOWSTART },
 		{ "snmp",		SNMP },
 		{ "socket",		SOCKET },
 		{ "source-hash",	SRCHASH },
@@ -2214,6 +2341,7 @@ lookup(char *s)
 		{ "url",		URL },
 		{ "value",		VALUE },
 		{ "virtual",		VIRTUAL },
+		{ "weight",		WEIGHT },
 		{ "with",		WITH }
 	};
 	const struct keywords	*p;
@@ -2632,6 +2760,15 @@ load_config(const char *filename, struct relayd *x_conf)
 		errors++;
 	}
 
+	/* The shared counters are sized at startup, see stat_slots() */
+	if (conf->sc_hostslots != 0 &&
+	    (last_host_id >= conf->sc_hostslots ||
+	    last_relay_id >= conf->sc_relayslots)) {
+		log_warnx("too many hosts or relays for a reload, "
+		    "restart relayd");
+		errors++;
+	}
+
 	/* Cleanup relay list to inherit */
 	while ((rlay = TAILQ_FIRST(&relays)) != NULL) {
 		TAILQ_REMOVE(&relays, rlay, rl_entry);
@@ -2691,6 +2828,12 @@ load_config(const char *filename, struct relayd *x_conf)
 			    table->conf.name);
 			errors++;
 		}
+		if (table->conf.eject_errors &&
+		    table->conf.check == CHECK_NOCHECK) {
+			log_warnx("table %s has no check to readmit "
+			    "ejected hosts", table->conf.name);
+			errors++;
+		}
 	}
 
 	/* Verify that every non-default protocol is used */
@@ -3061,6 +3204,14 @@ table_inherit(struct table *tb)
 	if (tb->conf.timeout.tv_sec == 0 && tb->conf.timeout.tv_usec == 0)
 		bcopy(&dsttb->conf.timeout, &tb->conf.timeout,
 		    sizeof(struct timeval));
+	if (!timerisset(&tb->conf.slowstart))
+		bcopy(&dsttb->conf.slowstart, &tb->conf.slowstart,
+		    sizeof(struct timeval));
+	if (tb->conf.eject_errors == 0) {
+		tb->conf.eject_errors = dsttb->conf.eject_errors;
+		bcopy(&dsttb->conf.eject_backoff, &tb->conf.eject_backoff,
+		    sizeof(struct timeval));
+	}
 
 	/* Copy the associated hosts */
 	TAILQ_INIT(&tb->hosts);
@@ -3161,7 +3312,8 @@ relay_inherit(struct relay *ra, struct relay *rb)
 	}
 
 	conf->sc_relaycount++;
-	SPLAY_INIT(&rlay->rl_sessions);
+	TAILQ_INIT(&rb->rl_sessions);
+	TAILQ_INIT(&rb->rl_backends);
 	TAILQ_INSERT_TAIL(conf->sc_relays, rb, rl_entry);
 
 	return (rb);
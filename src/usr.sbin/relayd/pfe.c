@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <event.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -48,9 +49,107 @@ void	 pfe_statistics(int, short, void *);
 int	 pfe_dispatch_parent(int, struct privsep_proc *, struct imsg *);
 int	 pfe_dispatch_hce(int, struct privsep_proc *, struct imsg *);
 int	 pfe_dispatch_relay(int, struct privsep_proc *, struct imsg *);
+int	 pfe_admitted(struct table *, struct host *);
+
+const char *metrics_label(const char *, char *, size_t);
+void	 metrics_type(struct evbuffer *, const char *, const char *,
+	    const char *);
+void	 metrics_histogram(struct evbuffer *, const char *, const char *,
+	    struct latency_counters *);
+u_int64_t metrics_relay(struct relay *, size_t);
+u_int64_t metrics_host_up(struct host *, struct host_counters *);
+u_int64_t metrics_host_checks(struct host *, struct host_counters *);
+u_int64_t metrics_host_checksup(struct host *, struct host_counters *);
+u_int64_t metrics_host_checkdur(struct host *, struct host_counters *);
+u_int64_t metrics_host_weight(struct host *, struct host_counters *);
+u_int64_t metrics_host_active(struct host *, struct host_counters *);
+u_int64_t metrics_host_sessions(struct host *, struct host_counters *);
+u_int64_t metrics_host_connfail(struct host *, struct host_counters *);
+u_int64_t metrics_host_failures(struct host *, struct host_counters *);
+u_int64_t metrics_host_ejected(struct host *, struct host_counters *);
+u_int64_t metrics_host_ejections(struct host *, struct host_counters *);
 
 static struct relayd		*env = NULL;
 
+/*
+ * The metric families, every family is printed as one block of samples
+ * following its HELP and TYPE lines.  The relay values are summed over
+ * the relay processes from the given offset in struct ctl_stats, the
+ * host values are returned by the given function.
+ */
+struct metrics_family {
+	const char	*name;
+	const char	*type;
+	const char	*help;
+	size_t		 off;
+	u_int64_t	(*host)(struct host *, struct host_counters *);
+	int		 usec;		/* the value is in microseconds */
+};
+
+#define METRICS_RELAY(_n, _t, _h, _f)					\
+	{ _n, _t, _h, offsetof(struct ctl_stats, _f), NULL, 0 }
+#define METRICS_HOST(_n, _t, _h, _f, _u)				\
+	{ _n, _t, _h, 0, _f, _u }
+
+static const struct metrics_family relay_families[] = {
+	METRICS_RELAY("relay_sessions_total", "counter",
+	    "Sessions accepted by the relay.", cnt),
+	METRICS_RELAY("relay_accepts_total", "counter",
+	    "Connections accepted by the relay.", accepts),
+	METRICS_RELAY("relay_accept_overflows_total", "counter",
+	    "Times the accept queue of the relay was full.", overflows),
+	METRICS_RELAY("relay_limit_pauses_total", "counter",
+	    "Times accepting was paused at the session limit.", limited),
+	METRICS_RELAY("relay_rejects_total", "counter",
+	    "Sessions refused by the relay.", rejects),
+	METRICS_RELAY("relay_requests_total", "counter",
+	    "HTTP requests relayed by closed sessions.", requests),
+	METRICS_RELAY("relay_received_bytes_total", "counter",
+	    "Data relayed from clients by closed sessions.", bytes_in),
+	METRICS_RELAY("relay_sent_bytes_total", "counter",
+	    "Data relayed to clients by closed sessions.", bytes_out),
+	METRICS_RELAY("relay_backends_idle", "gauge",
+	    "Idle backend connections kept for reuse.", backends)
+};
+
+/* Labels of the relay_closes_total family, see enum relay_closetype */
+static const char *relay_closetypes[RELAY_CLOSE_MAX] = {
+	"done", "timeout", "error"
+};
+
+static const struct metrics_family host_families[] = {
+	METRICS_HOST("host_up", "gauge",
+	    "Whether the host is up, 0 if it is down or unknown.",
+	    metrics_host_up, 0),
+	METRICS_HOST("host_checks_total", "counter",
+	    "Health checks of the host.", metrics_host_checks, 0),
+	METRICS_HOST("host_checks_up_total", "counter",
+	    "Health checks of the host that succeeded.",
+	    metrics_host_checksup, 0),
+	METRICS_HOST("host_check_duration_seconds", "gauge",
+	    "Duration of the last health check of the host.",
+	    metrics_host_checkdur, 1),
+	METRICS_HOST("host_weight", "gauge",
+	    "Balancing weight of the host.", metrics_host_weight, 0),
+	METRICS_HOST("host_sessions_active", "gauge",
+	    "Relay sessions to the host.", metrics_host_active, 0),
+	METRICS_HOST("host_sessions_total", "counter",
+	    "Relay sessions forwarded to the host.",
+	    metrics_host_sessions, 0),
+	METRICS_HOST("host_connect_failures_total", "counter",
+	    "Failed relay connections to the host.",
+	    metrics_host_connfail, 0),
+	METRICS_HOST("host_failures_total", "counter",
+	    "Relay sessions that failed at the host.",
+	    metrics_host_failures, 0),
+	METRICS_HOST("host_ejected", "gauge",
+	    "Whether the host is ejected from the relays.",
+	    metrics_host_ejected, 0),
+	METRICS_HOST("host_ejections_total", "counter",
+	    "Times the host was ejected after failed sessions.",
+	    metrics_host_ejections, 0)
+};
+
 static struct privsep_proc procs[] = {
 	{ "parent",	PROC_PARENT,	pfe_dispatch_parent },
 	{ "relay",	PROC_RELAY,	pfe_dispatch_relay },
@@ -71,6 +170,7 @@ pfe_init(struct privsep *ps, struct privsep_proc *p, void *arg)
 	if (config_init(ps->ps_env) == -1)
 		fatal("failed to initialize configuration");
 
+	sslcache_unmap(ps->ps_env);
 	p->p_shutdown = pfe_shutdown;
 }
 
@@ -103,9 +203,10 @@ pfe_disable_events(void)
 int
 pfe_dispatch_hce(int fd, struct privsep_proc *p, struct imsg *imsg)
 {
-	struct host		*host;
+	struct host		*host, *h;
 	struct table		*table;
 	struct ctl_status	 st;
+	struct timeval		 tv;
 
 	control_imsg_forward(imsg);
 
@@ -119,6 +220,7 @@ pfe_dispatch_hce(int fd, struct privsep_proc *p, struct imsg *imsg)
 		if (host->flags & F_DISABLE)
 			break;
 		host->retry_cnt = st.retry_cnt;
+		host->check_dur = st.duration;
 		if (st.up != HOST_UNKNOWN) {
 			host->check_cnt++;
 			if (st.up == HOST_UP)
@@ -130,6 +232,22 @@ pfe_dispatch_hce(int fd, struct privsep_proc *p, struct imsg *imsg)
 			fatalx("pfe_dispatch_hce: desynchronized");
 		}
 
+		if ((table = table_find(env, host->conf.tableid))
+		    == NULL)
+			fatalx("pfe_dispatch_hce: invalid table id");
+
+		/*
+		 * An ejected host is readmitted by the first passing
+		 * check after the backoff, or when its state changes.
+		 */
+		if (host->flags & F_EJECTED) {
+			getmonotime(&tv);
+			timersub(&tv, &host->eject_stamp, &tv);
+			if (st.up != HOST_UP ||
+			    !timercmp(&tv, &table->conf.eject_backoff, <))
+				readmit_host(host);
+		}
+
 		if (host->up == st.up)
 			break;
 
@@ -137,10 +255,6 @@ pfe_dispatch_hce(int fd, struct privsep_proc *p, struct imsg *imsg)
 		proc_compose_imsg(env->sc_ps, PROC_RELAY, -1,
 		    IMSG_HOST_STATUS, -1, &st, sizeof(st));
 
-		if ((table = table_find(env, host->conf.tableid))
-		    == NULL)
-			fatalx("pfe_dispatch_hce: invalid table id");
-
 		log_debug("%s: state %d for host %u %s", __func__,
 		    st.up, host->conf.id, host->conf.name);
 
@@ -161,6 +275,12 @@ pfe_dispatch_hce(int fd, struct privsep_proc *p, struct imsg *imsg)
 		}
 
 		host->up = st.up;
+
+		/* Readmit the ejected hosts if no other host is left */
+		if (!HOST_ISUP(st.up) && pfe_admitted(table, NULL) == 0)
+			TAILQ_FOREACH(h, &table->hosts, entry)
+				if (h->flags & F_EJECTED)
+					readmit_host(h);
 		break;
 	case IMSG_SYNC:
 		pfe_sync();
@@ -228,13 +348,20 @@ int
 pfe_dispatch_relay(int fd, struct privsep_proc *p, struct imsg *imsg)
 {
 	struct ctl_natlook	 cnl;
-	struct ctl_stats	 crs;
-	struct relay		*rlay;
 	struct ctl_conn		*c;
 	struct rsession		 con;
+	struct host		*host;
+	objid_t			 id;
 	int			 cid;
 
 	switch (imsg->hdr.type) {
+	case IMSG_HOST_EJECT:
+		IMSG_SIZE_CHECK(imsg, &id);
+		memcpy(&id, imsg->data, sizeof(id));
+		if ((host = host_find(env, id)) == NULL)
+			fatalx("pfe_dispatch_relay: invalid host id");
+		eject_host(host);
+		break;
 	case IMSG_NATLOOK:
 		IMSG_SIZE_CHECK(imsg, &cnl);
 		bcopy(imsg->data, &cnl, sizeof(cnl));
@@ -246,18 +373,6 @@ pfe_dispatch_relay(int fd, struct privsep_proc *p, struct imsg *imsg)
 		proc_compose_imsg(env->sc_ps, PROC_RELAY, cnl.proc,
 		    IMSG_NATLOOK, -1, &cnl, sizeof(cnl));
 		break;
-	case IMSG_STATISTICS:
-		IMSG_SIZE_CHECK(imsg, &crs);
-		bcopy(imsg->data, &crs, sizeof(crs));
-		if (crs.proc > env->sc_prefork_relay)
-			fatalx("pfe_dispatch_relay: "
-			    "invalid relay proc");
-		if ((rlay = relay_find(env, crs.id)) == NULL)
-			fatalx("pfe_dispatch_relay: invalid relay id");
-		bcopy(&crs, &rlay->rl_stats[crs.proc], sizeof(crs));
-		rlay->rl_stats[crs.proc].interval =
-		    env->sc_statinterval.tv_sec;
-		break;
 	case IMSG_CTL_SESSION:
 		IMSG_SIZE_CHECK(imsg, &con);
 		memcpy(&con, imsg->data, sizeof(con));
@@ -298,13 +413,26 @@ void
 show(struct ctl_conn *c)
 {
 	struct rdr		*rdr;
+	struct table		*table;
 	struct host		*host;
+	struct host_counters	*hc;
 	struct relay		*rlay;
 #ifndef __FreeBSD__
 	struct router		*rt;
 	struct netroute		*nr;
 #endif
 	struct relay_table	*rlt;
+	struct ctl_latency	 cl;
+	int			 i;
+
+	/* Read the host counters of the relays from the shared memory */
+	if (env->sc_tables != NULL)
+		TAILQ_FOREACH(table, env->sc_tables, entry)
+			TAILQ_FOREACH(host, &table->hosts, entry) {
+				hc = host_counters(env, host->conf.id);
+				host->connfail_cnt = hc->hc_connfail;
+				host->session_cnt = hc->hc_sessions;
+			}
 
 	if (env->sc_rdrs == NULL)
 		goto relays;
@@ -341,21 +469,39 @@ relays:
 		goto end;
 #endif
 	TAILQ_FOREACH(rlay, env->sc_relays, rl_entry) {
+		for (i = 0; i < env->sc_prefork_relay; i++) {
+			stat_relay(relay_counters(env, rlay->rl_conf.id, i),
+			    &rlay->rl_stats[i]);
+			rlay->rl_stats[i].id = rlay->rl_conf.id;
+			rlay->rl_stats[i].proc = i;
+		}
 		rlay->rl_stats[env->sc_prefork_relay].id = EMPTY_ID;
 		imsg_compose_event(&c->iev, IMSG_CTL_RELAY, 0, 0, -1,
 		    rlay, sizeof(*rlay));
 		imsg_compose_event(&c->iev, IMSG_CTL_RELAY_STATS, 0, 0, -1,
 		    &rlay->rl_stats, sizeof(rlay->rl_stats));
+		if (latency_get(latency_relay(env, rlay->rl_conf.id), &cl)) {
+			cl.id = rlay->rl_conf.id;
+			imsg_compose_event(&c->iev, IMSG_CTL_LATENCY, 0, 0, -1,
+			    &cl, sizeof(cl));
+		}
 
 		TAILQ_FOREACH(rlt, &rlay->rl_tables, rlt_entry) {
 			imsg_compose_event(&c->iev, IMSG_CTL_TABLE, 0, 0, -1,
 			    rlt->rlt_table, sizeof(*rlt->rlt_table));
-			if (!(rlt->rlt_table->conf.flags & F_DISABLE))
-				TAILQ_FOREACH(host,
-				    &rlt->rlt_table->hosts, entry)
-					imsg_compose_event(&c->iev,
-					    IMSG_CTL_HOST, 0, 0, -1,
-					    host, sizeof(*host));
+			if (rlt->rlt_table->conf.flags & F_DISABLE)
+				continue;
+			TAILQ_FOREACH(host, &rlt->rlt_table->hosts, entry) {
+				imsg_compose_event(&c->iev, IMSG_CTL_HOST,
+				    0, 0, -1, host, sizeof(*host));
+				if (!latency_get(latency_host(env,
+				    host->conf.id), &cl))
+					continue;
+				cl.id = host->conf.id;
+				cl.host = 1;
+				imsg_compose_event(&c->iev, IMSG_CTL_LATENCY,
+				    0, 0, -1, &cl, sizeof(cl));
+			}
 		}
 	}
 
@@ -385,6 +531,297 @@ end:
 	imsg_compose_event(&c->iev, IMSG_CTL_END, 0, 0, -1, NULL, 0);
 }
 
+/*
+ * Escape a name for use as a label value.
+ */
+const char *
+metrics_label(const char *name, char *buf, size_t len)
+{
+	size_t	 i = 0;
+
+	for (; *name != '\0' && i + 2 < len; name++) {
+		switch (*name) {
+		case '\\':
+		case '"':
+			buf[i++] = '\\';
+			buf[i++] = *name;
+			break;
+		case '\n':
+			buf[i++] = '\\';
+			buf[i++] = 'n';
+			break;
+		default:
+			buf[i++] = *name;
+			break;
+		}
+	}
+	buf[i] = '\0';
+
+	return (buf);
+}
+
+void
+metrics_type(struct evbuffer *buf, const char *name, const char *type,
+    const char *help)
+{
+	evbuffer_add_printf(buf, "# HELP relayd_%s %s\n", name, help);
+	evbuffer_add_printf(buf, "# TYPE relayd_%s %s\n", name, type);
+}
+
+/*
+ * Print the cumulative buckets of the latency histograms, skipping the
+ * buckets without samples.
+ */
+void
+metrics_histogram(struct evbuffer *buf, const char *name, const char *labels,
+    struct latency_counters *lc)
+{
+	static const char	*types[LATENCY_MAX] = {
+		"accept", "connect", "response", "session"
+	};
+	u_int64_t		 cnt, sum;
+	u_int32_t		 us;
+	u_int			 type, i;
+
+	for (type = 0; type < LATENCY_MAX; type++) {
+		cnt = 0;
+		for (i = 0; i < RELAY_HISTBUCKETS; i++) {
+			if (lc->lc_buckets[type][i] == 0)
+				continue;
+			cnt += lc->lc_buckets[type][i];
+			us = latency_value(i);
+			evbuffer_add_printf(buf, "relayd_%s_bucket{%s,"
+			    "type=\"%s\",le=\"%u.%06u\"} %llu\n",
+			    name, labels, types[type], us / 1000000,
+			    us % 1000000, (unsigned long long)cnt);
+		}
+		if (cnt == 0)
+			continue;
+		sum = lc->lc_sum[type];
+		evbuffer_add_printf(buf, "relayd_%s_bucket{%s,type=\"%s\","
+		    "le=\"+Inf\"} %llu\n", name, labels, types[type],
+		    (unsigned long long)cnt);
+		evbuffer_add_printf(buf, "relayd_%s_sum{%s,type=\"%s\"} "
+		    "%llu.%06llu\n", name, labels, types[type],
+		    (unsigned long long)(sum / 1000000),
+		    (unsigned long long)(sum % 1000000));
+		evbuffer_add_printf(buf, "relayd_%s_count{%s,type=\"%s\"} "
+		    "%llu\n", name, labels, types[type],
+		    (unsigned long long)cnt);
+	}
+}
+
+/*
+ * Return a counter of struct ctl_stats, summed over the relay processes.
+ */
+u_int64_t
+metrics_relay(struct relay *rlay, size_t off)
+{
+	struct ctl_stats	 crs;
+	u_int64_t		 sum = 0;
+	int			 i;
+
+	for (i = 0; i < env->sc_prefork_relay; i++) {
+		stat_relay(relay_counters(env, rlay->rl_conf.id, i), &crs);
+		sum += *(u_int64_t *)((char *)&crs + off);
+	}
+
+	return (sum);
+}
+
+u_int64_t
+metrics_host_up(struct host *host, struct host_counters *hc)
+{
+	return (host->up == HOST_UP);
+}
+
+u_int64_t
+metrics_host_checks(struct host *host, struct host_counters *hc)
+{
+	return (host->check_cnt);
+}
+
+u_int64_t
+metrics_host_checksup(struct host *host, struct host_counters *hc)
+{
+	return (host->up_cnt);
+}
+
+u_int64_t
+metrics_host_checkdur(struct host *host, struct host_counters *hc)
+{
+	return (host->check_dur);
+}
+
+u_int64_t
+metrics_host_weight(struct host *host, struct host_counters *hc)
+{
+	return (host->conf.weight);
+}
+
+u_int64_t
+metrics_host_active(struct host *host, struct host_counters *hc)
+{
+	return (hc->hc_active);
+}
+
+u_int64_t
+metrics_host_sessions(struct host *host, struct host_counters *hc)
+{
+	return (hc->hc_sessions);
+}
+
+u_int64_t
+metrics_host_connfail(struct host *host, struct host_counters *hc)
+{
+	return (hc->hc_connfail);
+}
+
+u_int64_t
+metrics_host_failures(struct host *host, struct host_counters *hc)
+{
+	return (hc->hc_failures);
+}
+
+u_int64_t
+metrics_host_ejected(struct host *host, struct host_counters *hc)
+{
+	return ((host->flags & F_EJECTED) != 0);
+}
+
+u_int64_t
+metrics_host_ejections(struct host *host, struct host_counters *hc)
+{
+	return (host->eject_cnt);
+}
+
+/*
+ * Render the counters in the Prometheus text format.  Everything is
+ * read from the configuration of the pfe and from the counters shared
+ * with the relays, so this does not involve the relay processes.
+ */
+void
+show_metrics(struct ctl_conn *c)
+{
+	struct evbuffer		*buf;
+	struct relay		*rlay;
+	struct table		*table;
+	struct host		*host;
+	const struct metrics_family *mf;
+	char			 rname[MAXHOSTNAMELEN * 2];
+	char			 tname[TABLE_NAME_SIZE * 2];
+	char			 hname[MAXHOSTNAMELEN * 2];
+	char			 labels[sizeof(tname) + sizeof(hname) + 32];
+	u_int64_t		 value;
+	size_t			 len;
+	u_int			 i;
+
+	if ((buf = evbuffer_new()) == NULL) {
+		imsg_compose_event(&c->iev, IMSG_CTL_END, 0, 0, -1, NULL, 0);
+		return;
+	}
+
+	if (env->sc_relays != NULL) {
+		for (i = 0; i < nitems(relay_families); i++) {
+			mf = &relay_families[i];
+			metrics_type(buf, mf->name, mf->type, mf->help);
+			TAILQ_FOREACH(rlay, env->sc_relays, rl_entry)
+				evbuffer_add_printf(buf,
+				    "relayd_%s{relay=\"%s\"} %llu\n", mf->name,
+				    metrics_label(rlay->rl_conf.name, rname,
+				    sizeof(rname)), (unsigned long long)
+				    metrics_relay(rlay, mf->off));
+		}
+
+		metrics_type(buf, "relay_closes_total", "counter",
+		    "Sessions closed by the relay, by reason.");
+		TAILQ_FOREACH(rlay, env->sc_relays, rl_entry) {
+			metrics_label(rlay->rl_conf.name, rname, sizeof(rname));
+			for (i = 0; i < RELAY_CLOSE_MAX; i++)
+				evbuffer_add_printf(buf,
+				    "relayd_relay_closes_total"
+				    "{relay=\"%s\",reason=\"%s\"} %llu\n",
+				    rname, relay_closetypes[i],
+				    (unsigned long long)metrics_relay(rlay,
+				    offsetof(struct ctl_stats, closes) +
+				    i * sizeof(u_int64_t)));
+		}
+
+		metrics_type(buf, "relay_latency_seconds", "histogram",
+		    "Latency of the relay sessions.");
+		TAILQ_FOREACH(rlay, env->sc_relays, rl_entry) {
+			snprintf(labels, sizeof(labels), "relay=\"%s\"",
+			    metrics_label(rlay->rl_conf.name, rname,
+			    sizeof(rname)));
+			metrics_histogram(buf, "relay_latency_seconds", labels,
+			    latency_relay(env, rlay->rl_conf.id));
+		}
+	}
+
+	if (env->sc_tables == NULL)
+		goto done;
+
+	metrics_type(buf, "table_hosts_up", "gauge",
+	    "Hosts of the table that are up.");
+	TAILQ_FOREACH(table, env->sc_tables, entry)
+		evbuffer_add_printf(buf,
+		    "relayd_table_hosts_up{table=\"%s\"} %d\n",
+		    metrics_label(table->conf.name, tname,
+		    sizeof(tname)), table->up);
+
+	for (i = 0; i < nitems(host_families); i++) {
+		mf = &host_families[i];
+		metrics_type(buf, mf->name, mf->type, mf->help);
+		TAILQ_FOREACH(table, env->sc_tables, entry) {
+			metrics_label(table->conf.name, tname, sizeof(tname));
+			TAILQ_FOREACH(host, &table->hosts, entry) {
+				value = mf->host(host,
+				    host_counters(env, host->conf.id));
+				evbuffer_add_printf(buf,
+				    "relayd_%s{table=\"%s\",host=\"%s\"} ",
+				    mf->name, tname,
+				    metrics_label(host->conf.name, hname,
+				    sizeof(hname)));
+				if (mf->usec)
+					evbuffer_add_printf(buf,
+					    "%llu.%06llu\n",
+					    (unsigned long long)
+					    (value / 1000000),
+					    (unsigned long long)
+					    (value % 1000000));
+				else
+					evbuffer_add_printf(buf, "%llu\n",
+					    (unsigned long long)value);
+			}
+		}
+	}
+
+	metrics_type(buf, "host_latency_seconds", "histogram",
+	    "Latency of the relay sessions to the host.");
+	TAILQ_FOREACH(table, env->sc_tables, entry) {
+		metrics_label(table->conf.name, tname, sizeof(tname));
+		TAILQ_FOREACH(host, &table->hosts, entry) {
+			snprintf(labels, sizeof(labels),
+			    "table=\"%s\",host=\"%s\"", tname,
+			    metrics_label(host->conf.name, hname,
+			    sizeof(hname)));
+			metrics_histogram(buf, "host_latency_seconds",
+			    labels, latency_host(env, host->conf.id));
+		}
+	}
+
+ done:
+	while ((len = EVBUFFER_LENGTH(buf)) > 0) {
+		len = MIN(len, MAX_IMSGSIZE - IMSG_HEADER_SIZE);
+		imsg_compose_event(&c->iev, IMSG_CTL_METRICS, 0, 0, -1,
+		    EVBUFFER_DATA(buf), len);
+		evbuffer_drain(buf, len);
+	}
+	evbuffer_free(buf);
+
+	imsg_compose_event(&c->iev, IMSG_CTL_END, 0, 0, -1, NULL, 0);
+}
+
 void
 show_sessions(struct ctl_conn *c)
 {
@@ -562,7 +999,7 @@ disable_host(struct ctl_conn *c, struct ctl_id *id, struct host *host)
 	host->up = HOST_UNKNOWN;
 	host->flags |= F_DISABLE;
 	host->flags |= F_DEL;
-	host->flags &= ~(F_ADD);
+	host->flags &= ~(F_ADD|F_EJECTED);
 	host->check_cnt = 0;
 	host->up_cnt = 0;
 
@@ -624,6 +1061,96 @@ enable_host(struct ctl_conn *c, struct ctl_id *id, struct host *host)
 	return (0);
 }
 
+int
+weight_host(struct ctl_conn *c, struct ctl_weight *cw)
+{
+	struct host	*host;
+
+	if (cw->id.id == EMPTY_ID)
+		host = host_findbyname(env, cw->id.name);
+	else
+		host = host_find(env, cw->id.id);
+	if (host == NULL || cw->weight < 1 || cw->weight > RELAY_MAXWEIGHT)
+		return (-1);
+	cw->id.id = host->conf.id;
+
+	if (host->conf.weight == cw->weight)
+		return (0);
+	host->conf.weight = cw->weight;
+
+	/* Forward to relay engine(s) */
+	proc_compose_imsg(env->sc_ps, PROC_RELAY, -1, IMSG_HOST_WEIGHT, -1,
+	    cw, sizeof(*cw));
+
+	log_debug("%s: host %d weight %d", __func__, host->conf.id,
+	    cw->weight);
+
+	return (0);
+}
+
+/*
+ * Count the hosts of a table that are up and used by the relays.
+ */
+int
+pfe_admitted(struct table *table, struct host *skip)
+{
+	struct host	*host;
+	int		 cnt = 0;
+
+	TAILQ_FOREACH(host, &table->hosts, entry)
+		if (host != skip && HOST_ISUP(host->up) &&
+		    !(host->flags & (F_DISABLE|F_EJECTED)))
+			cnt++;
+	return (cnt);
+}
+
+/*
+ * A relay reported too many consecutive failed sessions of the host:
+ * remove it from the relay tables until the backoff has passed and an
+ * active check succeeds again.  The last host of a table is kept.
+ */
+void
+eject_host(struct host *host)
+{
+	struct table	*table;
+
+	/* Let the relays count again */
+	host_counters(env, host->conf.id)->hc_errors = 0;
+
+	if ((host->flags & (F_DISABLE|F_EJECTED)) || !HOST_ISUP(host->up))
+		return;
+	if ((table = table_find(env, host->conf.tableid)) == NULL)
+		fatalx("eject_host: invalid table id");
+	if (pfe_admitted(table, host) == 0) {
+		log_debug("%s: host %s is the last active host", __func__,
+		    host->conf.name);
+		return;
+	}
+
+	host->flags |= F_EJECTED;
+	host->eject_cnt++;
+	getmonotime(&host->eject_stamp);
+
+	if (env->sc_opts & RELAYD_OPT_LOGUPDATE)
+		log_info("host %s, ejected after %d failed sessions",
+		    host->conf.name, table->conf.eject_errors);
+
+	proc_compose_imsg(env->sc_ps, PROC_RELAY, -1, IMSG_HOST_EJECT, -1,
+	    &host->conf.id, sizeof(host->conf.id));
+}
+
+void
+readmit_host(struct host *host)
+{
+	host->flags &= ~F_EJECTED;
+
+	if (env->sc_opts & RELAYD_OPT_LOGUPDATE)
+		log_info("host %s, readmitted", host->conf.name);
+
+	proc_compose_imsg(env->sc_ps, PROC_RELAY, -1, IMSG_HOST_READMIT, -1,
+	    &host->conf.id, sizeof(host->conf.id));
+}
+
 void
 pfe_sync(void)
 {
@@ -0,0 +1,153 @@
+/*	$FreeBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <event.h>
+
+#include <openssl/ssl.h>
+
+#include "relayd.h"
+
+/*
+ * Simple per-process object caches for the relay fast path.  Freed
+ * objects are kept on a bounded stack and handed out again instead of
+ * going through malloc(3) for every accepted connection.
+ */
+
+struct pool	 evbuffer_pool;
+
+void
+pool_init(struct pool *pl, const char *name, size_t size, u_int max)
+{
+	bzero(pl, sizeof(*pl));
+	pl->pl_name = name;
+	pl->pl_size = size;
+	pl->pl_max = max;
+	if ((pl->pl_items = calloc(max, sizeof(void *))) == NULL)
+		fatal("pool_init");
+}
+
+void
+pool_destroy(struct pool *pl)
+{
+	while (pl->pl_nitems > 0)
+		free(pl->pl_items[--pl->pl_nitems]);
+	free(pl->pl_items);
+	pl->pl_items = NULL;
+	pl->pl_max = 0;
+}
+
+/*
+ * Return a zeroed object, from the cache if possible.
+ */
+void *
+pool_get(struct pool *pl)
+{
+	void	*p;
+
+	if (pl->pl_nitems > 0) {
+		pl->pl_hits++;
+		p = pl->pl_items[--pl->pl_nitems];
+		bzero(p, pl->pl_size);
+		return (p);
+	}
+
+	pl->pl_misses++;
+	return (calloc(1, pl->pl_size));
+}
+
+void
+pool_put(struct pool *pl, void *p)
+{
+	if (p == NULL)
+		return;
+	if (pl->pl_nitems >= pl->pl_max) {
+		free(p);
+		return;
+	}
+	pl->pl_items[pl->pl_nitems++] = p;
+}
+
+/*
+ * Event buffers keep their storage while they are cached, so a recycled
+ * buffer usually does not need to allocate memory for the next session.
+ */
+struct evbuffer *
+pool_evbuffer_get(void)
+{
+	if (evbuffer_pool.pl_nitems > 0) {
+		evbuffer_pool.pl_hits++;
+		return (evbuffer_pool.pl_items[--evbuffer_pool.pl_nitems]);
+	}
+
+	evbuffer_pool.pl_misses++;
+	return (evbuffer_new());
+}
+
+void
+pool_evbuffer_put(struct evbuffer *buf)
+{
+	if (buf == NULL)
+		return;
+	if (evbuffer_pool.pl_nitems >= evbuffer_pool.pl_max ||
+	    buf->totallen > RELAY_POOL_BUFSIZ) {
+		evbuffer_free(buf);
+		return;
+	}
+	evbuffer_drain(buf, EVBUFFER_LENGTH(buf));
+	evbuffer_setcb(buf, NULL, NULL);
+	evbuffer_pool.pl_items[evbuffer_pool.pl_nitems++] = buf;
+}
+
+void
+pool_evbuffer_destroy(void)
+{
+	while (evbuffer_pool.pl_nitems > 0)
+		evbuffer_free(evbuffer_pool.pl_items[--evbuffer_pool.pl_nitems]);
+	pool_destroy(&evbuffer_pool);
+}
+
+/*
+ * Same as bufferevent_free() but return both buffers to the cache.
+ */
+void
+pool_bufferevent_free(struct bufferevent *bev)
+{
+	event_del(&bev->ev_read);
+	event_del(&bev->ev_write);
+
+	pool_evbuffer_put(bev->input);
+	pool_evbuffer_put(bev->output);
+
+	free(bev);
+}
+
+void
+pool_debug(struct pool *pl)
+{
+	log_debug("%s: pool %s: %u cached, %llu hits, %llu misses",
+	    __func__, pl->pl_name, pl->pl_nitems,
+	    (unsigned long long)pl->pl_hits,
+	    (unsigned long long)pl->pl_misses);
+}
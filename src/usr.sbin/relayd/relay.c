@@ -16,6 +16,10 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE		/* splice(2), pipe2(2) */
+#endif
+
 #ifdef __FreeBSD__
 #include <sys/param.h>
 #else
@@ -38,6 +42,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -53,6 +58,9 @@
 #include "relayd.h"
 
 void		 relay_statistics(int, short, void *);
+void		 relay_timer(int, short, void *);
+void		 relay_timer_expire(struct rsession *, struct timeval *);
+int		 relay_timer_connecting(struct rsession *);
 int		 relay_dispatch_parent(int, struct privsep_proc *,
 		    struct imsg *);
 int		 relay_dispatch_pfe(int, struct privsep_proc *,
@@ -68,11 +76,18 @@ void		 relay_launch(void);
 int		 relay_socket(struct sockaddr_storage *, in_port_t,
 		    struct protocol *, int, int);
 int		 relay_socket_listen(struct sockaddr_storage *, in_port_t,
-		    struct protocol *);
+		    struct protocol *, int);
 int		 relay_socket_connect(struct sockaddr_storage *, in_port_t,
 		    struct protocol *, int);
 
 void		 relay_accept(int, short, void *);
+void		 relay_backend_idle(int, short, void *);
+void		 relay_backend_free(struct relay_backend *);
+enum relay_closetype
+		 relay_closetype(struct rsession *, const char *);
+void		 relay_accept_session(struct relay *, int,
+		    struct sockaddr_storage *);
+void		 relay_accept_overflow(struct relay *, int);
 void		 relay_input(struct rsession *);
 
 u_int32_t	 relay_hash_addr(struct sockaddr_storage *, u_int32_t);
@@ -81,16 +96,52 @@ DH *		 relay_ssl_get_dhparams(int);
 void		 relay_ssl_callback_info(const SSL *, int, int);
 DH		*relay_ssl_callback_dh(SSL *, int, int);
 SSL_CTX		*relay_ssl_ctx_create(struct relay *);
+struct ssl_cacheslot
+		*relay_ssl_sess_lock(const unsigned char *, u_int);
+void		 relay_ssl_sess_unlock(struct ssl_cacheslot *);
+int		 relay_ssl_sess_new(SSL *, SSL_SESSION *);
+SSL_SESSION	*relay_ssl_sess_get(SSL *, unsigned char *, int, int *);
+void		 relay_ssl_sess_remove(SSL_CTX *, SSL_SESSION *);
 void		 relay_ssl_transaction(struct rsession *,
 		    struct ctl_relay_event *);
 void		 relay_ssl_accept(int, short, void *);
 #ifndef __FreeBSD__ /* file descriptor accounting */
 void		 relay_connect_retry(int, short, void *);
 #endif
+int		 relay_connect_failed(struct rsession *);
+u_int		 relay_host_sessions(struct host *);
+void		 relay_host_hold(struct rsession *);
+void		 relay_host_release(struct rsession *);
+int		 relay_host_least(struct relay_table *);
+int		 relay_host_swrr(struct relay_table *);
+int		 relay_host_random(struct relay_table *);
+int		 relay_host_ewma(struct relay_table *);
+u_int64_t	 relay_host_ewma_cost(struct host *, struct timeval *);
+u_int		 relay_host_ramp(struct relay_table *, struct host *);
+void		 relay_host_slowstart(struct table *, struct host *, int);
+void		 relay_host_slowstart_done(int, short, void *);
+int		 relay_host_active(struct table *, struct host *);
+int		 relay_host_ejected(struct relay_table *, int);
+int		 relay_host_failover(struct relay_table *, int);
+void		 relay_latency_add(struct rsession *, enum latency_type,
+		    struct timeval *);
+void		 relay_host_ewma_update(struct host *, struct timeval *,
+		    struct timeval *);
+void		 relay_uphosts_set(struct relay_table *, int, int);
+void		 relay_uphosts_build(struct relay_table *);
+void		 relay_lookup_build(struct relay_table *, u_int16_t *, int);
+int		 relay_lookup_member(struct relay_table *, int, int);
+int		 relay_lookup(struct relay_table *,
+		    u_int32_t);
+void		 relay_connect_next(int, short, void *);
 void		 relay_ssl_connect(int, short, void *);
 void		 relay_ssl_connected(struct ctl_relay_event *);
 void		 relay_ssl_readcb(int, short, void *);
 void		 relay_ssl_writecb(int, short, void *);
+#ifdef RELAY_SPLICE_PIPE
+void		 relay_splice_readcb(int, short, void *);
+void		 relay_splice_writecb(int, short, void *);
+#endif
 
 char		*relay_load_file(const char *, off_t *);
 extern void	 bufferevent_read_pressure_cb(struct evbuffer *, size_t,
@@ -104,6 +155,21 @@ volatile int relay_inflight = 0;
 #endif
 objid_t relay_conid;
 
+struct pool			 relay_session_pool;
+
+/*
+ * Session idle and connect timeouts are kept in a timer wheel with a
+ * resolution of one second.  Activity on a session only updates
+ * se_tv_last; the deadline is checked and the session is moved to a
+ * later slot when its slot expires, so re-arming a timeout is free.
+ */
+static struct {
+	struct sessionbucket	 tw_slots[RELAY_TIMER_SLOTS];
+	u_int			 tw_cur;
+	time_t			 tw_time;
+	struct event		 tw_ev;
+} relay_wheel;
+
 static struct relayd		*env = NULL;
 int				 proc_id;
 
@@ -127,6 +193,12 @@ void
 relay_shutdown(void)
 {
 	config_purge(env, CONFIG_ALL);
+
+	/* All sessions are closed, release the cached objects */
+	pool_destroy(&relay_session_pool);
+	pool_destroy(&relay_httpdesc_pool);
+	pool_evbuffer_destroy();
+
 	usleep(200);	/* XXX relay needs to shutdown last */
 }
 
@@ -267,6 +339,9 @@ relay_protodebug(struct relay *rlay)
 	if (proto->tcpflags)
 		fprintf(stderr, "\ttcp flags: %s\n",
 		    printb_flags(proto->tcpflags, TCPFLAG_BITS));
+	if (proto->tcpflags & TCPFLAG_ACCEPTFILTER)
+		fprintf(stderr, "\taccept filter: %s\n",
+		    proto->tcpacceptfilter);
 	if ((rlay->rl_conf.flags & (F_SSL|F_SSLCLIENT)) && proto->sslflags)
 		fprintf(stderr, "\tssl flags: %s\n",
 		    printb_flags(proto->sslflags, SSLFLAG_BITS));
@@ -317,17 +392,31 @@ relay_privinit(struct relay *rlay)
 		    rlay->rl_conf.port, rlay->rl_proto);
 	else
 		rlay->rl_s = relay_socket_listen(&rlay->rl_conf.ss,
-		    rlay->rl_conf.port, rlay->rl_proto);
+		    rlay->rl_conf.port, rlay->rl_proto,
+		    rlay->rl_conf.flags & F_REUSEPORT);
 	if (rlay->rl_s == -1)
 		return (-1);
 
 	return (0);
 }
 
+/*
+ * Open an additional listening socket bound to the same address for
+ * one of the relay instances; the kernel distributes new connections
+ * between all sockets of the SO_REUSEPORT group.
+ */
+int
+relay_privinit_shard(struct relay *rlay)
+{
+	return (relay_socket_listen(&rlay->rl_conf.ss,
+	    rlay->rl_conf.port, rlay->rl_proto, 1));
+}
+
 void
 relay_init(struct privsep *ps, struct privsep_proc *p, void *arg)
 {
 	struct timeval	 tv;
+	int		 n;
 
 	if (config_init(ps->ps_env) == -1)
 		fatal("failed to initialize configuration");
@@ -339,76 +428,174 @@ relay_init(struct privsep *ps, struct privsep_proc *p, void *arg)
 	p->p_shutdown = relay_shutdown;
 
 	/* Unlimited file descriptors (use system limits) */
-	socket_rlimit(-1);
+	n = socket_rlimit(-1);
+
+	/* Derive the session limit from the file descriptor budget */
+	if (env->sc_maxsessions == 0) {
+		n = (n - RELAY_FD_RESERVE) / RELAY_SESSION_FDS;
+		env->sc_maxsessions = MAX(n, 1);
+	}
+	log_debug("%s: session limit %u", __func__, env->sc_maxsessions);
+
+	/* Recycle sessions and their buffers */
+	pool_init(&relay_session_pool, "session",
+	    sizeof(struct rsession), RELAY_POOL_MAX);
+	pool_init(&evbuffer_pool, "evbuffer",
+	    sizeof(struct evbuffer), RELAY_POOL_MAX * 2);
 
 	/* Schedule statistics timer */
 	evtimer_set(&env->sc_statev, relay_statistics, NULL);
 	bcopy(&env->sc_statinterval, &tv, sizeof(tv));
 	evtimer_add(&env->sc_statev, &tv);
+
+	/* Start the session timer wheel */
+	for (n = 0; n < RELAY_TIMER_SLOTS; n++)
+		LIST_INIT(&relay_wheel.tw_slots[n]);
+	getmonotime(&tv);
+	relay_wheel.tw_time = tv.tv_sec;
+	evtimer_set(&relay_wheel.tw_ev, relay_timer, NULL);
+	relay_timer(-1, EV_TIMEOUT, NULL);
 }
 
 void
 relay_statistics(int fd, short events, void *arg)
 {
-	struct relay		*rlay;
-	struct ctl_stats	 crs, *cur;
-	struct timeval		 tv, tv_now;
-	int			 resethour = 0, resetday = 0;
-	struct rsession		*con, *next_con;
+	struct timeval		 tv;
 
 	/*
-	 * This is a hack to calculate some average statistics.
-	 * It doesn't try to be very accurate, but could be improved...
+	 * The session counters are kept in shared memory and read by
+	 * the pfe directly, only log the pool usage here.
 	 */
+	pool_debug(&relay_session_pool);
+	pool_debug(&evbuffer_pool);
+	if (relay_httpdesc_pool.pl_items != NULL)
+		pool_debug(&relay_httpdesc_pool);
+
+	/* Schedule statistics timer */
+	evtimer_set(&env->sc_statev, relay_statistics, NULL);
+	bcopy(&env->sc_statinterval, &tv, sizeof(tv));
+	evtimer_add(&env->sc_statev, &tv);
+}
+
+void
+relay_timer(int fd, short events, void *arg)
+{
+	struct sessionbucket	*slot;
+	struct rsession		*con;
+	struct timeval		 tv, tv_now;
 
-	timerclear(&tv);
 	getmonotime(&tv_now);
 
-	TAILQ_FOREACH(rlay, env->sc_relays, rl_entry) {
-		bzero(&crs, sizeof(crs));
-		resethour = resetday = 0;
-
-		cur = &rlay->rl_stats[proc_id];
-		cur->cnt += cur->last;
-		cur->tick++;
-		cur->avg = (cur->last + cur->avg) / 2;
-		cur->last_hour += cur->last;
-		if ((cur->tick % (3600 / env->sc_statinterval.tv_sec)) == 0) {
-			cur->avg_hour = (cur->last_hour + cur->avg_hour) / 2;
-			resethour++;
-		}
-		cur->last_day += cur->last;
-		if ((cur->tick % (86400 / env->sc_statinterval.tv_sec)) == 0) {
-			cur->avg_day = (cur->last_day + cur->avg_day) / 2;
-			resethour++;
-		}
-		bcopy(cur, &crs, sizeof(crs));
-
-		cur->last = 0;
-		if (resethour)
-			cur->last_hour = 0;
-		if (resetday)
-			cur->last_day = 0;
-
-		crs.id = rlay->rl_conf.id;
-		crs.proc = proc_id;
-		proc_compose_imsg(env->sc_ps, PROC_PFE, -1, IMSG_STATISTICS, -1,
-		    &crs, sizeof(crs));
-
-		for (con = SPLAY_ROOT(&rlay->rl_sessions);
-		    con != NULL; con = next_con) {
-			next_con = SPLAY_NEXT(session_tree,
-			    &rlay->rl_sessions, con);
-			timersub(&tv_now, &con->se_tv_last, &tv);
-			if (timercmp(&tv, &rlay->rl_conf.timeout, >=))
-				relay_close(con, "hard timeout");
+	/* Catch up with every second that passed since the last tick */
+	while (relay_wheel.tw_time < tv_now.tv_sec) {
+		relay_wheel.tw_time++;
+		relay_wheel.tw_cur =
+		    (relay_wheel.tw_cur + 1) % RELAY_TIMER_SLOTS;
+		slot = &relay_wheel.tw_slots[relay_wheel.tw_cur];
+
+		while ((con = LIST_FIRST(slot)) != NULL) {
+			LIST_REMOVE(con, se_timernode);
+			con->se_timerset = 0;
+			relay_timer_expire(con, &tv_now);
 		}
 	}
 
-	/* Schedule statistics timer */
-	evtimer_set(&env->sc_statev, relay_statistics, NULL);
-	bcopy(&env->sc_statinterval, &tv, sizeof(tv));
-	evtimer_add(&env->sc_statev, &tv);
+	timerclear(&tv);
+	tv.tv_sec = 1;
+	evtimer_add(&relay_wheel.tw_ev, &tv);
+}
+
+/*
+ * A TCP session that is waiting for the connection to the backend, or
+ * for the next connect retry, is timed from the start of the last
+ * connect, all others from the last I/O.
+ */
+int
+relay_timer_connecting(struct rsession *con)
+{
+	return ((con->se_relay->rl_conf.flags & F_UDP) == 0 &&
+	    (con->se_out.s != -1 || con->se_connretry) &&
+	    con->se_out.bev == NULL);
+}
+
+void
+relay_timer_add(struct rsession *con)
+{
+	struct timeval	*tv_base;
+	time_t		 ticks;
+	u_int		 slot;
+
+	if (con->se_timerset)
+		return;
+
+	tv_base = relay_timer_connecting(con) ?
+	    &con->se_tv_start : &con->se_tv_last;
+	ticks = tv_base->tv_sec + con->se_relay->rl_conf.timeout.tv_sec -
+	    relay_wheel.tw_time;
+
+	/* Deadlines beyond the wheel will be checked again on the way */
+	if (ticks < 1)
+		ticks = 1;
+	else if (ticks >= RELAY_TIMER_SLOTS)
+		ticks = RELAY_TIMER_SLOTS - 1;
+
+	slot = (relay_wheel.tw_cur + ticks) % RELAY_TIMER_SLOTS;
+	LIST_INSERT_HEAD(&relay_wheel.tw_slots[slot], con, se_timernode);
+	con->se_timerset = 1;
+}
+
+void
+relay_timer_del(struct rsession *con)
+{
+	if (!con->se_timerset)
+		return;
+	LIST_REMOVE(con, se_timernode);
+	con->se_timerset = 0;
+}
+
+void
+relay_timer_expire(struct rsession *con, struct timeval *tv_now)
+{
+	struct relay	*rlay = con->se_relay;
+	struct timeval	 tv;
+	int		 connecting;
+
+#ifdef RELAY_SPLICE
+	/* Spliced data does not pass the buffer events */
+	if (relay_splicelen(&con->se_in) == -1 ||
+	    relay_splicelen(&con->se_out) == -1) {
+		relay_close(con, strerror(errno));
+		return;
+	}
+#endif
+
+	connecting = relay_timer_connecting(con);
+	timersub(tv_now, connecting ? &con->se_tv_start : &con->se_tv_last,
+	    &tv);
+	if (timercmp(&tv, &rlay->rl_conf.timeout, <)) {
+		relay_timer_add(con);
+		return;
+	}
+
+	if (connecting) {
+		log_debug("%s: session %d: connect timeout",
+		    __func__, con->se_id);
+		/* No further retry if the backoff outlasted the timeout */
+		if (con->se_out.s != -1 && relay_connect_failed(con) == 0)
+			return;
+		relay_abort_http(con, 504, "connect timeout", 0);
+	} else {
+		/*
+		 * Only an HTTP request that is still waiting for its
+		 * response counts against the server, other sessions
+		 * may just be idle.
+		 */
+		if (rlay->rl_proto->type == RELAY_PROTO_HTTP &&
+		    con->se_pending > 0 && con->se_out.bev != NULL &&
+		    timerisset(&con->se_tv_request))
+			relay_host_outlier(con, 1);
+		relay_close(con, "session timeout");
+	}
 }
 
 void
@@ -416,10 +603,13 @@ relay_launch(void)
 {
 	void			(*callback)(int, short, void *);
 	struct relay		*rlay;
-	struct host		*host;
 	struct relay_table	*rlt;
 
 	TAILQ_FOREACH(rlay, env->sc_relays, rl_entry) {
+		rlay->rl_counters = relay_counters(env, rlay->rl_conf.id,
+		    proc_id);
+		rlay->rl_latency = latency_relay(env, rlay->rl_conf.id);
+
 		if ((rlay->rl_conf.flags & (F_SSL|F_SSLCLIENT)) &&
 		    (rlay->rl_ssl_ctx = relay_ssl_ctx_create(rlay)) == NULL)
 			fatal("relay_init: failed to create SSL context");
@@ -435,6 +625,8 @@ relay_launch(void)
 			switch (rlt->rlt_mode) {
 			case RELAY_DSTMODE_ROUNDROBIN:
 			case RELAY_DSTMODE_RANDOM:
+			case RELAY_DSTMODE_LEASTSTATES:
+			case RELAY_DSTMODE_LEASTLATENCY:
 				rlt->rlt_key = 0;
 				break;
 			case RELAY_DSTMODE_LOADBALANCE:
@@ -447,13 +639,20 @@ relay_launch(void)
 				    rlt->rlt_key);
 				break;
 			}
-			rlt->rlt_nhosts = 0;
-			TAILQ_FOREACH(host, &rlt->rlt_table->hosts, entry) {
-				if (rlt->rlt_nhosts >= RELAY_MAXHOSTS)
-					fatal("relay_init: "
-					    "too many hosts in table");
-				host->idx = rlt->rlt_nhosts;
-				rlt->rlt_host[rlt->rlt_nhosts++] = host;
+			relay_uphosts_build(rlt);
+			switch (rlt->rlt_mode) {
+			case RELAY_DSTMODE_LOADBALANCE:
+			case RELAY_DSTMODE_HASH:
+			case RELAY_DSTMODE_SRCHASH:
+				if (rlt->rlt_lookup == NULL &&
+				    (rlt->rlt_lookup = calloc(2 *
+				    RELAY_LOOKUP_SIZE, sizeof(u_int16_t))) ==
+				    NULL)
+					fatal("relay_init: lookup table");
+				relay_lookup_build(rlt, rlt->rlt_lookup, 0);
+				relay_lookup_build(rlt,
+				    rlt->rlt_lookup + RELAY_LOOKUP_SIZE, 1);
+				break;
 			}
 			log_info("adding %d hosts from table %s%s",
 			    rlt->rlt_nhosts, rlt->rlt_table->conf.name,
@@ -619,10 +818,24 @@ relay_socket_connect(struct sockaddr_storage *ss, in_port_t port,
     struct protocol *proto, int fd)
 {
 	int	s;
+#ifdef TCP_FASTOPEN_CONNECT
+	int	val;
+#endif
 
 	if ((s = relay_socket(ss, port, proto, fd, 0)) == -1)
 		return (-1);
 
+#ifdef TCP_FASTOPEN_CONNECT
+	/* Send the first write in the SYN if we have a cookie */
+	if (proto->tcpflags & TCPFLAG_FASTOPEN) {
+		val = 1;
+		if (setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+		    &val, sizeof(val)) == -1)
+			log_debug("%s: fastopen: %s", __func__,
+			    strerror(errno));
+	}
+#endif
+
 	if (connect(s, (struct sockaddr *)ss, ss->ss_len) == -1) {
 		if (errno != EINPROGRESS)
 			goto bad;
@@ -637,18 +850,76 @@ relay_socket_connect(struct sockaddr_storage *ss, in_port_t port,
 
 int
 relay_socket_listen(struct sockaddr_storage *ss, in_port_t port,
-    struct protocol *proto)
+    struct protocol *proto, int shard)
 {
 	int s;
+#if defined(SO_REUSEPORT_LB) || defined(TCP_FASTOPEN) || \
+    defined(TCP_DEFER_ACCEPT)
+	int val;
+#endif
+#ifdef SO_ACCEPTFILTER
+	struct accept_filter_arg afa;
+#endif
 
 	if ((s = relay_socket(ss, port, proto, -1, 1)) == -1)
 		return (-1);
 
+#ifdef SO_REUSEPORT_LB
+	/* FreeBSD only balances connections with SO_REUSEPORT_LB */
+	if (shard) {
+		val = 1;
+		if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT_LB,
+		    &val, sizeof(val)) == -1)
+			goto bad;
+	}
+#endif
+
 	if (bind(s, (struct sockaddr *)ss, ss->ss_len) == -1)
 		goto bad;
 	if (listen(s, proto->tcpbacklog) == -1)
 		goto bad;
 
+	/*
+	 * The following options are optimizations that depend on the
+	 * system configuration, like the net.inet.tcp.fastopen sysctls
+	 * or a loaded accept filter module.  Keep the listener without
+	 * them if they are not available.
+	 */
+#ifdef TCP_FASTOPEN
+	if (proto->tcpflags & TCPFLAG_FASTOPEN) {
+#ifdef __FreeBSD__
+		val = 1;
+#else
+		/* Linux takes the length of the pending fast open queue */
+		val = proto->tcpbacklog;
+#endif
+		if (setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN,
+		    &val, sizeof(val)) == -1)
+			log_warn("%s: fastopen", __func__);
+	}
+#endif
+
+	/*
+	 * Don't wake up the relay before the client has sent data,
+	 * or a full HTTP request with the "httpready" filter.
+	 */
+	if (proto->tcpflags & TCPFLAG_ACCEPTFILTER) {
+#if defined(SO_ACCEPTFILTER)
+		bzero(&afa, sizeof(afa));
+		(void)strlcpy(afa.af_name, proto->tcpacceptfilter,
+		    sizeof(afa.af_name));
+		if (setsockopt(s, SOL_SOCKET, SO_ACCEPTFILTER,
+		    &afa, sizeof(afa)) == -1)
+			log_warn("%s: accept filter %s", __func__,
+			    proto->tcpacceptfilter);
+#elif defined(TCP_DEFER_ACCEPT)
+		val = RELAY_DEFER_ACCEPT;
+		if (setsockopt(s, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		    &val, sizeof(val)) == -1)
+			log_warn("%s: accept filter", __func__);
+#endif
+	}
+
 	return (s);
 
  bad:
@@ -665,10 +936,12 @@ relay_connected(int fd, short sig, void *arg)
 	evbuffercb		 outwr = relay_write;
 	struct bufferevent	*bev;
 	struct ctl_relay_event	*out = &con->se_out;
+	struct timeval		 tv, tv_rtt;
 	socklen_t		 len;
 	int			 error;
 
 	if (sig == EV_TIMEOUT) {
+		relay_host_outlier(con, 1);
 		relay_abort_http(con, 504, "connect timeout", 0);
 		return;
 	}
@@ -678,6 +951,10 @@ relay_connected(int fd, short sig, void *arg)
 	    &len) == -1 || error) {
 		if (error)
 			errno = error;
+		log_debug("%s: session %d: connect failed: %s",
+		    __func__, con->se_id, strerror(errno));
+		if (relay_connect_failed(con) == 0)
+			return;
 		relay_abort_http(con, 500, "socket error", 0);
 		return;
 	}
@@ -689,9 +966,25 @@ relay_connected(int fd, short sig, void *arg)
 
 	DPRINTF("%s: session %d: successful", __func__, con->se_id);
 
+	getmonotime(&tv);
+	timersub(&tv, &con->se_tv_accept, &tv_rtt);
+	relay_latency_add(con, LATENCY_ACCEPT, &tv_rtt);
+	if (timerisset(&con->se_tv_connect)) {
+		timersub(&tv, &con->se_tv_connect, &tv_rtt);
+		relay_latency_add(con, LATENCY_CONNECT, &tv_rtt);
+		if (con->se_host != NULL)
+			relay_host_ewma_update(con->se_host, &tv_rtt, &tv);
+		timerclear(&con->se_tv_connect);
+	}
+	/* Measure the response time from now if the request is queued */
+	if (timerisset(&con->se_tv_request) || (con->se_out.output != NULL &&
+	    EVBUFFER_LENGTH(con->se_out.output)))
+		con->se_tv_request = tv;
+
 	switch (rlay->rl_proto->type) {
 	case RELAY_PROTO_HTTP:
-		if (relay_httpdesc_init(out) == -1) {
+		/* The descriptor is kept if the backend was released */
+		if (out->desc == NULL && relay_httpdesc_init(out) == -1) {
 			relay_close(con,
 			    "failed to allocate http descriptor");
 			return;
@@ -715,21 +1008,21 @@ relay_connected(int fd, short sig, void *arg)
 		    "failed to allocate output buffer event", 0);
 		return;
 	}
-	evbuffer_free(bev->output);
+	pool_evbuffer_put(bev->output);
 	bev->output = con->se_out.output;
 	if (bev->output == NULL)
 		fatal("relay_connected: invalid output buffer");
 	con->se_out.bev = bev;
+	bufferevent_setwatermark(bev, EV_WRITE,
+	    rlay->rl_conf.buflow, rlay->rl_conf.bufhigh);
 
 	/* Initialize the SSL wrapper */
 	if ((rlay->rl_conf.flags & F_SSLCLIENT) && (out->ssl != NULL))
 		relay_ssl_connected(out);
 
-	bufferevent_settimeout(bev,
-	    rlay->rl_conf.timeout.tv_sec, rlay->rl_conf.timeout.tv_sec);
 	bufferevent_enable(bev, EV_READ|EV_WRITE);
 
-#ifndef __FreeBSD__
+#ifdef RELAY_SPLICE
 	if (relay_splice(&con->se_out) == -1)
 		relay_close(con, strerror(errno));
 #endif
@@ -768,16 +1061,16 @@ relay_input(struct rsession *con)
 		relay_close(con, "failed to allocate input buffer event");
 		return;
 	}
+	bufferevent_setwatermark(con->se_in.bev, EV_WRITE,
+	    rlay->rl_conf.buflow, rlay->rl_conf.bufhigh);
 
 	/* Initialize the SSL wrapper */
 	if ((rlay->rl_conf.flags & F_SSL) && con->se_in.ssl != NULL)
 		relay_ssl_connected(&con->se_in);
 
-	bufferevent_settimeout(con->se_in.bev,
-	    rlay->rl_conf.timeout.tv_sec, rlay->rl_conf.timeout.tv_sec);
 	bufferevent_enable(con->se_in.bev, EV_READ|EV_WRITE);
 
-#ifndef __FreeBSD__
+#ifdef RELAY_SPLICE
 	if (relay_splice(&con->se_in) == -1)
 		relay_close(con, strerror(errno));
 #endif
@@ -791,9 +1084,18 @@ relay_write(struct bufferevent *bev, void *arg)
 
 	getmonotime(&con->se_tv_last);
 
-	if (con->se_done)
+	/*
+	 * The output has drained to the low watermark; finish the
+	 * session once it is empty or resume reading from the peer.
+	 */
+	if (con->se_done) {
+		if (EVBUFFER_LENGTH(EVBUFFER_OUTPUT(bev)))
+			return;
 		goto done;
-#ifndef __FreeBSD__
+	}
+	if (cre->dst->bev != NULL)
+		bufferevent_enable(cre->dst->bev, EV_READ);
+#ifdef RELAY_SPLICE
 	if (relay_splice(cre->dst) == -1)
 		goto fail;
 #endif
@@ -801,7 +1103,7 @@ relay_write(struct bufferevent *bev, void *arg)
  done:
 	relay_close(con, "last write (done)");
 	return;
-#ifndef __FreeBSD__
+#ifdef RELAY_SPLICE
  fail:
 	relay_close(con, strerror(errno));
 #endif
@@ -834,15 +1136,16 @@ relay_read(struct bufferevent *bev, void *arg)
 
 	getmonotime(&con->se_tv_last);
 	cre->timedout = 0;
+	relay_host_sample(cre);
 
 	if (!EVBUFFER_LENGTH(src))
 		return;
+	cre->bytes += EVBUFFER_LENGTH(src);
 	if (relay_bufferevent_write_buffer(cre->dst, src) == -1)
 		goto fail;
 	if (con->se_done)
 		goto done;
-	if (cre->dst->bev)
-		bufferevent_enable(cre->dst->bev, EV_READ);
+	relay_bufferevent_pressure(cre);
 	return;
  done:
 	relay_close(con, "last read (done)");
@@ -851,14 +1154,16 @@ relay_read(struct bufferevent *bev, void *arg)
 	relay_close(con, strerror(errno));
 }
 
-#ifndef __FreeBSD__
+#ifdef RELAY_SPLICE
 int
 relay_splice(struct ctl_relay_event *cre)
 {
 	struct rsession		*con = cre->con;
 	struct relay		*rlay = con->se_relay;
 	struct protocol		*proto = rlay->rl_proto;
+#ifndef RELAY_SPLICE_PIPE
 	struct splice		 sp;
+#endif
 
 	if ((rlay->rl_conf.flags & (F_SSL|F_SSLCLIENT)) ||
 	    (proto->tcpflags & TCPFLAG_NSPLICE))
@@ -886,6 +1191,31 @@ relay_splice(struct ctl_relay_event *cre)
 		return (0);
 	}
 
+#ifdef RELAY_SPLICE_PIPE
+	if (cre->splicepipe[0] == -1 &&
+	    pipe2(cre->splicepipe, O_NONBLOCK|O_CLOEXEC) == -1) {
+		log_debug("%s: session %d: splice dir %d pipe failed: %s",
+		    __func__, con->se_id, cre->dir, strerror(errno));
+		return (-1);
+	}
+	cre->splicemax = cre->toread > 0 ? cre->toread : 0;
+	cre->splicebytes = 0;
+	cre->splicepending = 0;
+	cre->spliceeof = 0;
+
+	/* the socket is now read by splice(2), not by the buffer event */
+	bufferevent_disable(cre->bev, EV_READ);
+	event_set(&cre->splicerev, cre->s, EV_READ,
+	    relay_splice_readcb, cre);
+	event_set(&cre->splicewev, cre->dst->s, EV_WRITE,
+	    relay_splice_writecb, cre);
+	if (event_add(&cre->splicerev, NULL) == -1) {
+		log_debug("%s: session %d: splice dir %d failed: %s",
+		    __func__, con->se_id, cre->dir, strerror(errno));
+		return (-1);
+	}
+	cre->splicelen = 0;
+#else
 	bzero(&sp, sizeof(sp));
 	sp.sp_fd = cre->dst->s;
 	sp.sp_max = cre->toread > 0 ? cre->toread : 0;
@@ -897,6 +1227,7 @@ relay_splice(struct ctl_relay_event *cre)
 	}
 	cre->splicelen = 0;
 	bufferevent_enable(cre->bev, EV_READ);
+#endif
 
 	DPRINTF("%s: session %d: splice dir %d, maximum %lld, successful",
 	    __func__, con->se_id, cre->dir, cre->toread);
@@ -909,17 +1240,23 @@ relay_splicelen(struct ctl_relay_event *cre)
 {
 	struct rsession		*con = cre->con;
 	off_t			 len;
+#ifndef RELAY_SPLICE_PIPE
 	socklen_t		 optlen;
+#endif
 
 	if (cre->splicelen < 0)
 		return (0);
 
+#ifdef RELAY_SPLICE_PIPE
+	len = cre->splicebytes;
+#else
 	optlen = sizeof(len);
 	if (getsockopt(cre->s, SOL_SOCKET, SO_SPLICE, &len, &optlen) == -1) {
 		log_debug("%s: session %d: splice dir %d get length failed: %s",
 		    __func__, con->se_id, cre->dir, strerror(errno));
 		return (-1);
 	}
+#endif
 
 	DPRINTF("%s: session %d: splice dir %d, length %lld",
 	    __func__, con->se_id, cre->dir, len);
@@ -941,14 +1278,123 @@ relay_spliceadjust(struct ctl_relay_event *cre)
 		return (0);
 	if (relay_splicelen(cre) == -1)
 		return (-1);
-	if (cre->splicelen > 0 && cre->toread > 0)
-		cre->toread -= cre->splicelen;
+	if (cre->splicelen > 0) {
+		/* Account for the data moved by the kernel */
+		cre->bytes += cre->splicelen;
+		if (cre->toread > 0)
+			cre->toread -= cre->splicelen;
+	}
 	cre->splicelen = -1;
+#ifdef RELAY_SPLICE_PIPE
+	/* unsplice, the pipe is always empty at this point */
+	event_del(&cre->splicerev);
+	event_del(&cre->splicewev);
+#endif
 
 	return (0);
 }
 #endif
 
+#ifdef RELAY_SPLICE_PIPE
+/*
+ * Userland driven socket splicing: move the data from the source socket
+ * into the session pipe and from the pipe into the destination socket
+ * with splice(2), without copying it through the evbuffers.  Errors,
+ * EOF and the end of a limited transfer are reported through
+ * relay_error() the same way SO_SPLICE reports them; idle sessions are
+ * found by the session timer.
+ */
+void
+relay_splice_readcb(int fd, short event, void *arg)
+{
+	struct ctl_relay_event	*cre = arg;
+	struct rsession		*con = cre->con;
+	size_t			 len = RELAY_SPLICE_CHUNK;
+	ssize_t			 n;
+
+	if (cre->splicemax > 0 &&
+	    (off_t)len > cre->splicemax - cre->splicebytes)
+		len = cre->splicemax - cre->splicebytes;
+
+	n = splice(fd, NULL, cre->splicepipe[1], NULL, len,
+	    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			goto retry;
+		goto fail;
+	}
+	if (n == 0)
+		cre->spliceeof = 1;
+	cre->splicepending += n;
+
+	relay_splice_writecb(cre->dst->s, EV_WRITE, cre);
+	return;
+
+ retry:
+	event_add(&cre->splicerev, NULL);
+	return;
+
+ fail:
+	relay_close(con, strerror(errno));
+}
+
+void
+relay_splice_writecb(int fd, short event, void *arg)
+{
+	struct ctl_relay_event	*cre = arg;
+	struct rsession		*con = cre->con;
+	ssize_t			 n;
+
+	while (cre->splicepending > 0) {
+		n = splice(cre->splicepipe[0], NULL, fd, NULL,
+		    cre->splicepending, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				goto retry;
+			goto fail;
+		}
+		cre->splicepending -= n;
+		cre->splicebytes += n;
+	}
+
+	if (cre->spliceeof) {
+		relay_error(cre->bev, EVBUFFER_READ|EVBUFFER_EOF, cre);
+		return;
+	}
+	if (cre->splicemax > 0 && cre->splicebytes >= cre->splicemax) {
+		/* maximum reached, continue with the buffer event */
+		errno = EFBIG;
+		relay_error(cre->bev, EVBUFFER_READ|EVBUFFER_ERROR, cre);
+		return;
+	}
+
+	event_add(&cre->splicerev, NULL);
+	return;
+
+ retry:
+	/* wait for the destination, do not read more meanwhile */
+	event_add(&cre->splicewev, NULL);
+	return;
+
+ fail:
+	relay_close(con, strerror(errno));
+}
+
+void
+relay_splice_close(struct ctl_relay_event *cre)
+{
+	if (cre->splicepipe[0] == -1)
+		return;
+	if (cre->splicelen >= 0) {
+		event_del(&cre->splicerev);
+		event_del(&cre->splicewev);
+	}
+	close(cre->splicepipe[0]);
+	close(cre->splicepipe[1]);
+	cre->splicepipe[0] = cre->splicepipe[1] = -1;
+}
+#endif
+
 void
 relay_error(struct bufferevent *bev, short error, void *arg)
 {
@@ -956,10 +1402,19 @@ relay_error(struct bufferevent *bev, short error, void *arg)
 	struct rsession		*con = cre->con;
 	struct evbuffer		*dst;
 
+	/* The server failed while a response was pending */
+	if (cre->dir == RELAY_DIR_RESPONSE &&
+	    timerisset(&con->se_tv_request) &&
+	    (error & (EVBUFFER_ERROR|EVBUFFER_TIMEOUT)) &&
+	    cre->splicelen < 0 && cre->dst->splicelen < 0)
+		relay_host_outlier(con, 1);
+
 	if (error & EVBUFFER_TIMEOUT) {
-#ifndef __FreeBSD__
+#ifdef RELAY_SPLICE
 		if (cre->splicelen >= 0) {
+#ifndef RELAY_SPLICE_PIPE
 			bufferevent_enable(bev, EV_READ);
+#endif
 		} else if (cre->dst->splicelen >= 0) {
 			switch (relay_splicelen(cre->dst)) {
 			case -1:
@@ -981,7 +1436,7 @@ relay_error(struct bufferevent *bev, short error, void *arg)
 		return;
 	}
 	if (error & EVBUFFER_ERROR && errno == ETIMEDOUT) {
-#ifndef __FreeBSD__
+#ifdef RELAY_SPLICE
 		if (cre->dst->splicelen >= 0) {
 			switch (relay_splicelen(cre->dst)) {
 			case -1:
@@ -1007,7 +1462,7 @@ relay_error(struct bufferevent *bev, short error, void *arg)
 		return;
 	}
 	if (error & EVBUFFER_ERROR && errno == EFBIG) {
-#ifndef __FreeBSD__
+#ifdef RELAY_SPLICE
 		if (relay_spliceadjust(cre) == -1)
 			goto fail;
 		bufferevent_enable(cre->bev, EV_READ);
@@ -1024,15 +1479,18 @@ relay_error(struct bufferevent *bev, short error, void *arg)
 			dst = EVBUFFER_OUTPUT(cre->dst->bev);
 			if (EVBUFFER_LENGTH(dst))
 				return;
-		} else
+		} else if (cre->dst->s != -1 || (cre->dst->output != NULL &&
+		    EVBUFFER_LENGTH(cre->dst->output))) {
+			/* Wait for the backend if there is data to forward */
 			return;
+		}
 
 		relay_close(con, "done");
 		return;
 	}
 	relay_close(con, "buffer event error");
 	return;
-#ifndef __FreeBSD__ /* no socket splicing */
+#ifdef RELAY_SPLICE
  fail:
 	relay_close(con, strerror(errno));
 #endif
@@ -1042,45 +1500,122 @@ void
 relay_accept(int fd, short event, void *arg)
 {
 	struct relay		*rlay = arg;
-	struct rsession		*con = NULL;
-	struct ctl_natlook	*cnl = NULL;
+	struct protocol		*proto = rlay->rl_proto;
 	socklen_t		 slen;
-	struct timeval		 tv;
 	struct sockaddr_storage	 ss;
-	int			 s = -1;
+	int			 s, n;
 
 	event_add(&rlay->rl_ev, NULL);
 	if ((event & EV_TIMEOUT))
 		return;
 
-	slen = sizeof(ss);
+	/* Drain up to the configured number of pending connections */
+	for (n = 0; n < proto->tcpacceptbatch; n++) {
+		if (relay_session_full(rlay)) {
+			relay_accept_pause(rlay);
+			return;
+		}
+
+		slen = sizeof(ss);
 #ifndef __FreeBSD__ /* file descriptor accounting */
-	if ((s = accept_reserve(fd, (struct sockaddr *)&ss,
-	    &slen, FD_RESERVE, &relay_inflight)) == -1) {
+		if ((s = accept_reserve(fd, (struct sockaddr *)&ss,
+		    &slen, FD_RESERVE, &relay_inflight)) == -1) {
+#elif defined(SOCK_NONBLOCK)
+		if ((s = accept4(fd, (struct sockaddr *)&ss, &slen,
+		    SOCK_NONBLOCK)) == -1) {
 #else
-	if ((s = accept(fd, (struct sockaddr *)&ss, (socklen_t *)&slen)) == -1) {
+		if ((s = accept(fd, (struct sockaddr *)&ss,
+		    (socklen_t *)&slen)) == -1) {
 #endif
-		/*
-		 * Pause accept if we are out of file descriptors, or
-		 * libevent will haunt us here too.
-		 */
-		if (errno == ENFILE || errno == EMFILE) {
-			struct timeval evtpause = { 1, 0 };
+			/*
+			 * Pause accept if we are out of file descriptors, or
+			 * libevent will haunt us here too.
+			 */
+			if (errno == ENFILE || errno == EMFILE) {
+				struct timeval evtpause = { 1, 0 };
 
-			event_del(&rlay->rl_ev);
-			evtimer_add(&rlay->rl_evt, &evtpause);
-			log_debug("%s: deferring connections", __func__);
+				event_del(&rlay->rl_ev);
+				evtimer_add(&rlay->rl_evt, &evtpause);
+				log_debug("%s: deferring connections",
+				    __func__);
+			}
+			return;
 		}
-		return;
+		rlay->rl_counters->rc_accepts++;
+		relay_accept_session(rlay, s, &ss);
 	}
-	if (relay_sessions >= RELAY_MAX_SESSIONS ||
-	    rlay->rl_conf.flags & F_DISABLE)
+
+	/* The budget is exhausted, check if the kernel queue is full */
+	if (proto->tcpacceptbatch > 1)
+		relay_accept_overflow(rlay, fd);
+}
+
+/*
+ * Leave new connections in the listen queue while the session limit
+ * is reached; relay_close() resumes accepting when a session is gone.
+ */
+void
+relay_accept_pause(struct relay *rlay)
+{
+	struct timeval	 evtpause = { 1, 0 };
+
+	rlay->rl_counters->rc_limited++;
+	event_del(&rlay->rl_ev);
+	evtimer_add(&rlay->rl_evt, &evtpause);
+	DPRINTF("%s: relay %s: session limit reached, deferring connections",
+	    __func__, rlay->rl_conf.name);
+}
+
+int
+relay_session_full(struct relay *rlay)
+{
+	if ((u_int)relay_sessions >= env->sc_maxsessions)
+		return (1);
+	if (rlay->rl_conf.maxsessions &&
+	    rlay->rl_nsessions >= rlay->rl_conf.maxsessions)
+		return (1);
+	return (0);
+}
+
+void
+relay_accept_overflow(struct relay *rlay, int fd)
+{
+#ifdef SO_LISTENQLEN
+	int		 qlen, qlimit;
+	socklen_t	 len;
+
+	len = sizeof(qlen);
+	if (getsockopt(fd, SOL_SOCKET, SO_LISTENQLEN, &qlen, &len) == -1)
+		return;
+	len = sizeof(qlimit);
+	if (getsockopt(fd, SOL_SOCKET, SO_LISTENQLIMIT, &qlimit, &len) == -1)
+		return;
+	if (qlen < qlimit)
+		return;
+
+	rlay->rl_counters->rc_overflows++;
+	DPRINTF("%s: relay %s: accept queue full (%d)", __func__,
+	    rlay->rl_conf.name, qlen);
+#endif
+}
+
+void
+relay_accept_session(struct relay *rlay, int s, struct sockaddr_storage *ss)
+{
+	struct rsession		*con = NULL;
+	struct ctl_natlook	*cnl = NULL;
+	socklen_t		 slen;
+	struct timeval		 tv;
+
+	if (rlay->rl_conf.flags & F_DISABLE)
 		goto err;
 
+#if !defined(__FreeBSD__) || !defined(SOCK_NONBLOCK)
 	if (fcntl(s, F_SETFL, O_NONBLOCK) == -1)
 		goto err;
+#endif
 
-	if ((con = calloc(1, sizeof(*con))) == NULL)
+	if ((con = pool_get(&relay_session_pool)) == NULL)
 		goto err;
 
 	con->se_in.s = s;
@@ -1091,9 +1626,13 @@ relay_accept(int fd, short event, void *arg)
 	con->se_out.dst = &con->se_in;
 	con->se_in.con = con;
 	con->se_out.con = con;
-#ifndef __FreeBSD__
+#ifdef RELAY_SPLICE
 	con->se_in.splicelen = -1;
 	con->se_out.splicelen = -1;
+#endif
+#ifdef RELAY_SPLICE_PIPE
+	con->se_in.splicepipe[0] = con->se_in.splicepipe[1] = -1;
+	con->se_out.splicepipe[0] = con->se_out.splicepipe[1] = -1;
 #endif
 	con->se_in.toread = TOREAD_UNLIMITED;
 	con->se_out.toread = TOREAD_UNLIMITED;
@@ -1106,27 +1645,29 @@ relay_accept(int fd, short event, void *arg)
 	con->se_retry = rlay->rl_conf.dstretry;
 	con->se_bnds = -1;
 	con->se_out.port = rlay->rl_conf.dstport;
-	switch (ss.ss_family) {
+	switch (ss->ss_family) {
 	case AF_INET:
-		con->se_in.port = ((struct sockaddr_in *)&ss)->sin_port;
+		con->se_in.port = ((struct sockaddr_in *)ss)->sin_port;
 		break;
 	case AF_INET6:
-		con->se_in.port = ((struct sockaddr_in6 *)&ss)->sin6_port;
+		con->se_in.port = ((struct sockaddr_in6 *)ss)->sin6_port;
 		break;
 	}
-	bcopy(&ss, &con->se_in.ss, sizeof(con->se_in.ss));
+	bcopy(ss, &con->se_in.ss, sizeof(con->se_in.ss));
 
 	getmonotime(&con->se_tv_start);
 	bcopy(&con->se_tv_start, &con->se_tv_last, sizeof(con->se_tv_last));
+	con->se_tv_accept = con->se_tv_start;
 
 	relay_sessions++;
-	SPLAY_INSERT(session_tree, &rlay->rl_sessions, con);
+	session_insert(rlay, con);
+	relay_timer_add(con);
 
 	/* Increment the per-relay session counter */
-	rlay->rl_stats[proc_id].last++;
+	stat_session(rlay->rl_counters, con->se_tv_start.tv_sec);
 
 	/* Pre-allocate output buffer */
-	con->se_out.output = evbuffer_new();
+	con->se_out.output = pool_evbuffer_get();
 	if (con->se_out.output == NULL) {
 		relay_close(con, "failed to allocate output buffer");
 		return;
@@ -1134,7 +1675,7 @@ relay_accept(int fd, short event, void *arg)
 
 	/* Pre-allocate log buffer */
 	con->se_haslog = 0;
-	con->se_log = evbuffer_new();
+	con->se_log = pool_evbuffer_get();
 	if (con->se_log == NULL) {
 		relay_close(con, "failed to allocate log buffer");
 		return;
@@ -1201,10 +1742,11 @@ relay_accept(int fd, short event, void *arg)
 	relay_session(con);
 	return;
  err:
+	rlay->rl_counters->rc_rejects++;
 	if (s != -1) {
 		close(s);
 		if (con != NULL)
-			free(con);
+			pool_put(&relay_session_pool, con);
 #ifndef __FreeBSD__ /* file descriptor accounting */
 		/*
 		 * the session struct was not completly set up, but still
@@ -1236,6 +1778,560 @@ relay_hash_addr(struct sockaddr_storage *ss, u_int32_t p)
 	return (p);
 }
 
+/*
+ * The active sessions of each host are counted in memory that is shared
+ * by all relay processes, indexed by the host id.
+ */
+u_int
+relay_host_sessions(struct host *host)
+{
+	return (host_counters(env, host->conf.id)->hc_active);
+}
+
+void
+relay_host_hold(struct rsession *con)
+{
+	struct host_counters	*hc;
+
+	if (con->se_hostheld || con->se_host == NULL)
+		return;
+	con->se_hostslot = con->se_host->conf.id;
+	hc = host_counters(env, con->se_hostslot);
+	__sync_fetch_and_add(&hc->hc_active, 1);
+	__sync_fetch_and_add(&hc->hc_sessions, 1);
+	con->se_hostheld = 1;
+}
+
+void
+relay_host_release(struct rsession *con)
+{
+	if (!con->se_hostheld)
+		return;
+	__sync_fetch_and_sub(&env->sc_hoststats[con->se_hostslot].hc_active,
+	    1);
+	con->se_hostheld = 0;
+}
+
+/*
+ * Return the index of the active host with the fewest sessions, starting
+ * the search at a rotating offset to spread ties between the hosts.
+ */
+int
+relay_host_least(struct relay_table *rlt)
+{
+	struct host	*host;
+	u_int		 cnt, min = UINT_MAX;
+	int		 i, n, idx = -1;
+
+	for (n = 0; n < rlt->rlt_nup; n++) {
+		i = rlt->rlt_up[(rlt->rlt_key + n) % rlt->rlt_nup];
+		host = rlt->rlt_host[i];
+		cnt = relay_host_sessions(host);
+		if (timerisset(&host->slowstart))
+			cnt = (cnt + 1) * RELAY_SLOWSTART_SCALE /
+			    relay_host_ramp(rlt, host);
+		if (cnt < min) {
+			min = cnt;
+			idx = i;
+		}
+	}
+	rlt->rlt_key++;
+
+	return (idx);
+}
+
+/*
+ * The active hosts of a relay table are kept in a compact array which
+ * is updated when the state of a host changes, so the balancing modes
+ * never have to skip over hosts that are down.  A table without checks
+ * treats all of its hosts as active, hosts that have been ejected after
+ * failed sessions are never active.
+ */
+int
+relay_host_active(struct table *table, struct host *host)
+{
+	if (host->flags & F_EJECTED)
+		return (0);
+	return (!table->conf.check || host->up == HOST_UP);
+}
+
+void
+relay_uphosts_set(struct relay_table *rlt, int idx, int up)
+{
+	int	 pos = rlt->rlt_uppos[idx], last;
+
+	if (up && pos == -1) {
+		rlt->rlt_uppos[idx] = rlt->rlt_nup;
+		rlt->rlt_up[rlt->rlt_nup++] = idx;
+	} else if (!up && pos != -1) {
+		/* Move the last entry into the free position */
+		last = rlt->rlt_up[--rlt->rlt_nup];
+		rlt->rlt_up[pos] = last;
+		rlt->rlt_uppos[last] = pos;
+		rlt->rlt_uppos[idx] = -1;
+	}
+}
+
+void
+relay_uphosts_build(struct relay_table *rlt)
+{
+	struct table	*table = rlt->rlt_table;
+	int		 i;
+
+	rlt->rlt_nup = 0;
+	for (i = 0; i < rlt->rlt_nhosts; i++)
+		rlt->rlt_uppos[i] = -1;
+	for (i = 0; i < rlt->rlt_nhosts; i++)
+		relay_uphosts_set(rlt, i,
+		    relay_host_active(table, rlt->rlt_host[i]));
+}
+
+/*
+ * Consistent hashing for the hash modes, using the weighted Maglev
+ * lookup table population: every host fills the free slots of the table
+ * in the order of its own permutation, so few slots move when the set
+ * of hosts changes.  Each round adds the weight of a host to its
+ * credit, and a host takes one slot for every maximum weight of credit.
+ * The hosts with the highest weight take a slot in every round, the
+ * others in proportion to their weight.  Every host starts with enough
+ * credit to take a slot in the first round, so none is left out when
+ * the table fills up before its turn.
+ */
+void
+relay_lookup_build(struct relay_table *rlt, u_int16_t *lookup, int uponly)
+{
+	struct host	*host;
+	u_int32_t	*pos, *skip, *credit, h;
+	u_int		 n = 0, wmax = 0;
+	int		 i, filled;
+
+	for (i = 0; i < RELAY_LOOKUP_SIZE; i++)
+		lookup[i] = RELAY_LOOKUP_EMPTY;
+	if (rlt->rlt_nhosts == 0)
+		return;
+
+	if ((pos = calloc(rlt->rlt_nhosts, sizeof(*pos))) == NULL ||
+	    (skip = calloc(rlt->rlt_nhosts, sizeof(*skip))) == NULL ||
+	    (credit = calloc(rlt->rlt_nhosts, sizeof(*credit))) == NULL)
+		fatal("relay_lookup_build");
+
+	for (i = 0; i < rlt->rlt_nhosts; i++) {
+		host = rlt->rlt_host[i];
+		h = hash32_str(host->conf.name, HASHINIT);
+		pos[i] = h % RELAY_LOOKUP_SIZE;
+		skip[i] = hash32_str(host->conf.name, h) %
+		    (RELAY_LOOKUP_SIZE - 1) + 1;
+		if (!relay_lookup_member(rlt, i, uponly))
+			continue;
+		if (host->conf.weight > 0 && (u_int)host->conf.weight > wmax)
+			wmax = host->conf.weight;
+	}
+	for (i = 0; i < rlt->rlt_nhosts; i++)
+		credit[i] = wmax - 1;
+
+	do {
+		filled = 0;
+		for (i = 0; i < rlt->rlt_nhosts && n < RELAY_LOOKUP_SIZE;
+		    i++) {
+			host = rlt->rlt_host[i];
+			if (!relay_lookup_member(rlt, i, uponly) ||
+			    host->conf.weight <= 0)
+				continue;
+			credit[i] += host->conf.weight;
+			if (credit[i] < wmax)
+				continue;
+			credit[i] -= wmax;
+			while (lookup[pos[i]] != RELAY_LOOKUP_EMPTY)
+				pos[i] = (pos[i] + skip[i]) %
+				    RELAY_LOOKUP_SIZE;
+			lookup[pos[i]] = i;
+			pos[i] = (pos[i] + skip[i]) % RELAY_LOOKUP_SIZE;
+			filled++;
+			n++;
+		}
+	} while (filled && n < RELAY_LOOKUP_SIZE);
+
+	free(pos);
+	free(skip);
+	free(credit);
+}
+
+/*
+ * The lookup table of the active hosts leaves out the hosts that are
+ * down or still in slow-start.
+ */
+int
+relay_lookup_member(struct relay_table *rlt, int idx, int uponly)
+{
+	if (!uponly)
+		return (1);
+	return (rlt->rlt_uppos[idx] != -1 &&
+	    !timerisset(&rlt->rlt_host[idx]->slowstart));
+}
+
+/*
+ * Keys of an active host always map to the same host.  Only the keys
+ * of a host that is down are redistributed, through the second table
+ * which only contains the active hosts.  A host in slow-start gets back
+ * a growing part of its keys, the others still use the second table.
+ */
+int
+relay_lookup(struct relay_table *rlt, u_int32_t p)
+{
+	u_int16_t	 idx;
+
+	idx = rlt->rlt_lookup[p % RELAY_LOOKUP_SIZE];
+	if (idx != RELAY_LOOKUP_EMPTY && rlt->rlt_uppos[idx] != -1 &&
+	    (p / RELAY_LOOKUP_SIZE) % RELAY_SLOWSTART_SCALE <
+	    relay_host_ramp(rlt, rlt->rlt_host[idx]))
+		return (idx);
+
+	idx = rlt->rlt_lookup[RELAY_LOOKUP_SIZE + p % RELAY_LOOKUP_SIZE];
+	if (idx == RELAY_LOOKUP_EMPTY)
+		return (-1);
+	return (idx);
+}
+
+/*
+ * Update the relay tables after a state change of the table, or only
+ * of the given host.  The lookup table of all hosts only has to be
+ * rebuilt if the host weights have changed.
+ */
+void
+relay_table_update(struct table *table, struct host *host, int all)
+{
+	struct relay		*rlay;
+	struct relay_table	*rlt;
+
+	TAILQ_FOREACH(rlay, env->sc_relays, rl_entry)
+		TAILQ_FOREACH(rlt, &rlay->rl_tables, rlt_entry) {
+			if (rlt->rlt_table != table)
+				continue;
+			if (host == NULL)
+				relay_uphosts_build(rlt);
+			else
+				relay_uphosts_set(rlt, host->idx,
+				    relay_host_active(table, host));
+			if (rlt->rlt_lookup == NULL)
+				continue;
+			if (all)
+				relay_lookup_build(rlt, rlt->rlt_lookup, 0);
+			relay_lookup_build(rlt,
+			    rlt->rlt_lookup + RELAY_LOOKUP_SIZE, 1);
+		}
+}
+
+/*
+ * Smooth weighted round-robin: every active host gains its weight and
+ * the host with the highest current weight is selected and loses the
+ * total weight.  Equal weights result in a plain round-robin.
+ */
+int
+relay_host_swrr(struct relay_table *rlt)
+{
+	struct host	*host;
+	int		 i, n, w, total = 0, idx = -1;
+
+	for (n = 0; n < rlt->rlt_nup; n++) {
+		i = rlt->rlt_up[n];
+		host = rlt->rlt_host[i];
+		w = host->conf.weight * relay_host_ramp(rlt, host);
+		rlt->rlt_weight[i] += w;
+		total += w;
+		if (idx == -1 || rlt->rlt_weight[i] > rlt->rlt_weight[idx])
+			idx = i;
+	}
+	if (idx != -1)
+		rlt->rlt_weight[idx] -= total;
+
+	return (idx);
+}
+
+int
+relay_host_random(struct relay_table *rlt)
+{
+	struct host	*host;
+	u_int32_t	 total = 0, r, w;
+	int		 i, n;
+
+	for (n = 0; n < rlt->rlt_nup; n++) {
+		host = rlt->rlt_host[rlt->rlt_up[n]];
+		total += host->conf.weight * relay_host_ramp(rlt, host);
+	}
+	if (total == 0)
+		return (-1);
+
+	r = arc4random_uniform(total);
+	for (n = 0; n < rlt->rlt_nup; n++) {
+		i = rlt->rlt_up[n];
+		host = rlt->rlt_host[i];
+		w = host->conf.weight * relay_host_ramp(rlt, host);
+		if (r < w)
+			return (i);
+		r -= w;
+	}
+
+	return (-1);
+}
+
+/*
+ * Peak-EWMA latency of a host: a slower sample replaces the cost right
+ * away, faster samples and idle time only let it decay slowly.  The
+ * cost is kept per relay process from the connect and response times
+ * of its own sessions.
+ */
+void
+relay_host_ewma_update(struct host *host, struct timeval *rtt,
+    struct timeval *now)
+{
+	struct timeval	 tv;
+	u_int64_t	 us, elapsed;
+
+	us = (u_int64_t)rtt->tv_sec * 1000000 + rtt->tv_usec;
+	timersub(now, &host->ewma_stamp, &tv);
+	elapsed = (u_int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	host->ewma_stamp = *now;
+
+	if (us >= host->ewma_cost || elapsed > 16 * RELAY_EWMA_DECAY)
+		host->ewma_cost = us;
+	else
+		host->ewma_cost -= (host->ewma_cost - us) * elapsed /
+		    (elapsed + RELAY_EWMA_DECAY);
+}
+
+u_int64_t
+relay_host_ewma_cost(struct host *host, struct timeval *now)
+{
+	struct timeval	 tv;
+	u_int64_t	 elapsed, cost;
+	u_int		 cnt;
+
+	timersub(now, &host->ewma_stamp, &tv);
+	elapsed = (u_int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	if (elapsed > 16 * RELAY_EWMA_DECAY)
+		cost = 0;
+	else
+		cost = host->ewma_cost * RELAY_EWMA_DECAY /
+		    (elapsed + RELAY_EWMA_DECAY);
+
+	/* Penalize the sessions in flight, of all relay processes */
+	cnt = relay_host_sessions(host);
+	if (cost == 0 && cnt > 0)
+		cost = RELAY_EWMA_PENALTY;
+
+	return ((cost + 1) * (cnt + 1) / host->conf.weight);
+}
+
+/*
+ * Power of two choices: pick two different active hosts at random and
+ * use the one with the lower latency cost.
+ */
+int
+relay_host_ewma(struct relay_table *rlt)
+{
+	struct timeval	 tv;
+	int		 a, b;
+
+	if (rlt->rlt_nup == 0)
+		return (-1);
+	if (rlt->rlt_nup == 1)
+		return (rlt->rlt_up[0]);
+
+	a = arc4random_uniform(rlt->rlt_nup);
+	b = arc4random_uniform(rlt->rlt_nup - 1);
+	if (b >= a)
+		b++;
+	a = rlt->rlt_up[a];
+	b = rlt->rlt_up[b];
+
+	getmonotime(&tv);
+	if (relay_host_ewma_cost(rlt->rlt_host[b], &tv) *
+	    RELAY_SLOWSTART_SCALE / relay_host_ramp(rlt, rlt->rlt_host[b]) <
+	    relay_host_ewma_cost(rlt->rlt_host[a], &tv) *
+	    RELAY_SLOWSTART_SCALE / relay_host_ramp(rlt, rlt->rlt_host[a]))
+		return (b);
+	return (a);
+}
+
+/*
+ * Slow-start: a host that returned to service gets a share of the new
+ * sessions that grows linearly over the slow-start window of its table.
+ * Returns the current step of the ramp, up to RELAY_SLOWSTART_SCALE.
+ */
+u_int
+relay_host_ramp(struct relay_table *rlt, struct host *host)
+{
+	struct table	*table = rlt->rlt_table;
+	struct timeval	 tv;
+	u_int64_t	 elapsed, window;
+
+	if (!timerisset(&host->slowstart))
+		return (RELAY_SLOWSTART_SCALE);
+
+	/* The end of the window is handled by relay_host_slowstart_done() */
+	getmonotime(&tv);
+	timersub(&tv, &host->slowstart, &tv);
+	if (!timercmp(&tv, &table->conf.slowstart, <))
+		return (RELAY_SLOWSTART_SCALE);
+
+	elapsed = (u_int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	window = (u_int64_t)table->conf.slowstart.tv_sec * 1000000 +
+	    table->conf.slowstart.tv_usec;
+	return (MAX(elapsed * RELAY_SLOWSTART_SCALE / window, 1));
+}
+
+/*
+ * Start or stop the slow-start window of a host.  A timer ends the
+ * window, so the host selection does not have to check for it.
+ */
+void
+relay_host_slowstart(struct table *table, struct host *host, int start)
+{
+	if (evtimer_initialized(&host->slowstart_ev))
+		evtimer_del(&host->slowstart_ev);
+	timerclear(&host->slowstart);
+
+	if (!start || !timerisset(&table->conf.slowstart))
+		return;
+
+	getmonotime(&host->slowstart);
+	evtimer_set(&host->slowstart_ev, relay_host_slowstart_done, host);
+	evtimer_add(&host->slowstart_ev, &table->conf.slowstart);
+}
+
+void
+relay_host_slowstart_done(int fd, short event, void *arg)
+{
+	struct host	*host = arg;
+	struct table	*table;
+
+	if ((table = table_find(env, host->conf.tableid)) == NULL)
+		fatalx("relay_host_slowstart_done: invalid table id");
+
+	DPRINTF("%s: host %s: slow-start done", __func__, host->conf.name);
+
+	timerclear(&host->slowstart);
+
+	/* Add the host to the lookup table of the active hosts */
+	relay_table_update(table, host, 0);
+}
+
+/*
+ * The remaining hosts of a table that is up have all been ejected, until
+ * the pfe readmits one of them.  Keep using them instead of failing.
+ */
+int
+relay_host_ejected(struct relay_table *rlt, int idx)
+{
+	struct table	*table = rlt->rlt_table;
+	struct host	*host;
+	int		 i, n;
+
+	for (n = 0; n < rlt->rlt_nhosts; n++) {
+		i = (idx + n) % rlt->rlt_nhosts;
+		host = rlt->rlt_host[i];
+		if ((host->flags & F_EJECTED) &&
+		    (!table->conf.check || host->up == HOST_UP))
+			return (i);
+	}
+
+	return (-1);
+}
+
+/*
+ * Select the next active host after the one that failed to connect.
+ * The failed host is only returned if it is the last one left.
+ */
+int
+relay_host_failover(struct relay_table *rlt, int failed)
+{
+	int		 i, n;
+
+	for (n = 1; n <= rlt->rlt_nhosts; n++) {
+		i = (failed + n) % rlt->rlt_nhosts;
+		if (rlt->rlt_uppos[i] != -1)
+			return (i);
+	}
+
+	return (-1);
+}
+
+/*
+ * Passive health checks: count the consecutive failed sessions of a
+ * host, shared by all relay processes, and report the host to the pfe
+ * once the limit of its table is reached.  Any successful response
+ * resets the count.
+ */
+void
+relay_host_outlier(struct rsession *con, int failed)
+{
+	struct host		*host = con->se_host;
+	struct host_counters	*hc;
+	struct table		*table;
+
+	if (host == NULL)
+		return;
+	hc = host_counters(env, host->conf.id);
+	if (!failed) {
+		if (hc->hc_errors)
+			hc->hc_errors = 0;
+		return;
+	}
+
+	__sync_fetch_and_add(&hc->hc_failures, 1);
+	if ((host->flags & F_EJECTED) ||
+	    (table = table_find(env, host->conf.tableid)) == NULL ||
+	    table->conf.eject_errors == 0)
+		return;
+	if (__sync_add_and_fetch(&hc->hc_errors, 1) !=
+	    (u_int)table->conf.eject_errors)
+		return;
+
+	log_debug("%s: session %d: host %s failed %d times", __func__,
+	    con->se_id, host->conf.name, table->conf.eject_errors);
+	proc_compose_imsg(env->sc_ps, PROC_PFE, -1, IMSG_HOST_EJECT, -1,
+	    &host->conf.id, sizeof(host->conf.id));
+}
+
+/*
+ * Take the time between relaying client data to the host and the
+ * first byte of its response as a latency sample.
+ */
+void
+relay_host_sample(struct ctl_relay_event *cre)
+{
+	struct rsession	*con = cre->con;
+	struct timeval	 tv;
+
+	if (cre->dir == RELAY_DIR_REQUEST) {
+		if (!timerisset(&con->se_tv_request))
+			con->se_tv_request = con->se_tv_last;
+	} else if (timerisset(&con->se_tv_request)) {
+		timersub(&con->se_tv_last, &con->se_tv_request, &tv);
+		relay_latency_add(con, LATENCY_RESPONSE, &tv);
+		if (con->se_host != NULL)
+			relay_host_ewma_update(con->se_host, &tv,
+			    &con->se_tv_last);
+		timerclear(&con->se_tv_request);
+		/* HTTP responses are checked for server errors instead */
+		if (con->se_relay->rl_proto->type != RELAY_PROTO_HTTP)
+			relay_host_outlier(con, 0);
+	}
+}
+
+/*
+ * Record a latency sample in the histograms of the relay and of the
+ * selected host.
+ */
+void
+relay_latency_add(struct rsession *con, enum latency_type type,
+    struct timeval *tv)
+{
+	latency_add(con->se_relay->rl_latency, type, tv);
+	if (con->se_host != NULL)
+		latency_add(latency_host(env, con->se_host->conf.id), type, tv);
+}
+
 int
 relay_from_table(struct rsession *con)
 {
@@ -1276,14 +2372,27 @@ relay_from_table(struct rsession *con)
 		con->se_hashkeyset = 1;
 	}
 
+	/*
+	 * Fail over to another host after a connect failure, the
+	 * scheduler is not consulted as its choice would be replaced.
+	 */
+	if (con->se_connretry && con->se_host != NULL &&
+	    con->se_host->conf.tableid == table->conf.id &&
+	    (idx = relay_host_failover(rlt, con->se_host->idx)) != -1)
+		goto gothost;
+
 	switch (rlt->rlt_mode) {
 	case RELAY_DSTMODE_ROUNDROBIN:
-		if ((int)rlt->rlt_key >= rlt->rlt_nhosts)
-			rlt->rlt_key = 0;
-		idx = (int)rlt->rlt_key;
+		idx = relay_host_swrr(rlt);
 		break;
 	case RELAY_DSTMODE_RANDOM:
-		idx = (int)arc4random_uniform(rlt->rlt_nhosts);
+		idx = relay_host_random(rlt);
+		break;
+	case RELAY_DSTMODE_LEASTSTATES:
+		idx = relay_host_least(rlt);
+		break;
+	case RELAY_DSTMODE_LEASTLATENCY:
+		idx = relay_host_ewma(rlt);
 		break;
 	case RELAY_DSTMODE_SRCHASH:
 	case RELAY_DSTMODE_LOADBALANCE:
@@ -1302,32 +2411,36 @@ relay_from_table(struct rsession *con)
 		fatalx("relay_from_table: unsupported mode");
 		/* NOTREACHED */
 	}
-	if (idx == -1 && (idx = p % rlt->rlt_nhosts) >= RELAY_MAXHOSTS)
-		return (-1);
+	if (idx == -1 && rlt->rlt_lookup != NULL)
+		idx = relay_lookup(rlt, p);
+	if (idx == -1)
+		idx = p % rlt->rlt_nhosts;
+
+	/* Pick another active host if the selected one is down */
+	if (rlt->rlt_uppos[idx] == -1) {
+		if (rlt->rlt_nup > 0)
+			idx = rlt->rlt_up[idx % rlt->rlt_nup];
+		else if ((idx = relay_host_ejected(rlt, idx)) == -1) {
+			/* Should not happen */
+			fatalx("relay_from_table: no active hosts, "
+			    "desynchronized");
+		}
+	}
+
+ gothost:
 	host = rlt->rlt_host[idx];
 	DPRINTF("%s: session %d: table %s host %s, p 0x%08x, idx %d",
 	    __func__, con->se_id, table->conf.name, host->conf.name, p, idx);
-	while (host != NULL) {
-		DPRINTF("%s: session %d: host %s", __func__,
-		    con->se_id, host->conf.name);
-		if (!table->conf.check || host->up == HOST_UP)
-			goto found;
-		host = TAILQ_NEXT(host, entry);
-	}
-	TAILQ_FOREACH(host, &table->hosts, entry) {
-		DPRINTF("%s: session %d: next host %s",
-		    __func__, con->se_id, host->conf.name);
-		if (!table->conf.check || host->up == HOST_UP)
-			goto found;
-	}
-
-	/* Should not happen */
-	fatalx("relay_from_table: no active hosts, desynchronized");
-
- found:
-	if (rlt->rlt_mode == RELAY_DSTMODE_ROUNDROBIN)
-		rlt->rlt_key = host->idx + 1;
-	con->se_retry = host->conf.retry;
+
+	/*
+	 * Use the configured retries, or fail over to a few other hosts
+	 * in the table if there are none.
+	 */
+	if (con->se_connretry == 0)
+		con->se_retry = host->conf.retry ? host->conf.retry :
+		    MIN(rlt->rlt_nhosts - 1, RELAY_FAILOVER_MAX);
+	con->se_host = host;
+	relay_host_hold(con);
 	con->se_out.port = table->conf.port;
 	bcopy(&host->conf.ss, &con->se_out.ss, sizeof(con->se_out.ss));
 
@@ -1508,11 +2621,12 @@ relay_connect_retry(int fd, short sig, void *arg)
 
 	event_add(&rlay->rl_ev, NULL);
 
-	if (errno == EINPROGRESS)
-		event_again(&con->se_ev, con->se_out.s, EV_WRITE|EV_TIMEOUT,
-		    relay_connected, &con->se_tv_start, &rlay->rl_conf.timeout,
-		    con);
-	else
+	/* The connect timeout is handled by the session timer */
+	if (errno == EINPROGRESS) {
+		event_set(&con->se_ev, con->se_out.s, EV_WRITE,
+		    relay_connected, con);
+		event_add(&con->se_ev, NULL);
+	} else
 		relay_connected(con->se_out.s, EV_WRITE, con);
 
 	return;
@@ -1586,7 +2700,17 @@ relay_connect(struct rsession *con)
 		}
 	}
 
- retry:
+	/* Reuse an idle connection to the selected backend */
+	if (relay_backend_get(con) == 0) {
+#ifndef __FreeBSD__ /* file descriptor accounting */
+		relay_inflight--;
+		DPRINTF("%s: inflight decremented, now %d",__func__,
+		    relay_inflight);
+#endif
+		relay_connected(con->se_out.s, EV_WRITE, con);
+		return (0);
+	}
+
 	if ((con->se_out.s = relay_socket_connect(&con->se_out.ss,
 	    con->se_out.port, rlay->rl_proto, bnds)) == -1) {
 #ifndef __FreeBSD__ /* file descriptor accounting */
@@ -1600,31 +2724,14 @@ relay_connect(struct rsession *con)
 			evtimer_add(&rlay->rl_evt, &evtpause);
 			return (0);
 		} else {
-			if (con->se_retry) {
-				con->se_retry--;
-				log_debug("%s: session %d: "
-				    "forward failed: %s, %s", __func__,
-				    con->se_id, strerror(errno),
-				    con->se_retry ?
-				    "next retry" : "last retry");
-				goto retry;
-			}
 			log_debug("%s: session %d: forward failed: %s",
 			    __func__, con->se_id, strerror(errno));
-			return (-1);
+			return (relay_connect_failed(con));
 		}
 #else
-		if (con->se_retry) {
-			con->se_retry--;
-			log_debug("%s: session %d: "
-			    "forward failed: %s, %s", __func__,
-			    con->se_id, strerror(errno),
-			    con->se_retry ? "next retry" : "last retry");
-			goto retry;
-		}
 		log_debug("%s: session %d: forward failed: %s", __func__,
 		    con->se_id, strerror(errno));
-		return (-1);
+		return (relay_connect_failed(con));
 #endif
 	}
 
@@ -1633,31 +2740,294 @@ relay_connect(struct rsession *con)
 	DPRINTF("%s: inflight decremented, now %d",__func__,
 	    relay_inflight);
 #endif
-
-	if (errno == EINPROGRESS)
-		event_again(&con->se_ev, con->se_out.s, EV_WRITE|EV_TIMEOUT,
-		    relay_connected, &con->se_tv_start, &rlay->rl_conf.timeout,
-		    con);
-	else
+	con->se_tv_connect = con->se_tv_start;
+
+	/* The connect timeout is handled by the session timer */
+	if (errno == EINPROGRESS) {
+		event_set(&con->se_ev, con->se_out.s, EV_WRITE,
+		    relay_connected, con);
+		event_add(&con->se_ev, NULL);
+	} else
 		relay_connected(con->se_out.s, EV_WRITE, con);
 
 	return (0);
 }
 
+/*
+ * Count a failed connection attempt and schedule the next one with an
+ * exponential backoff.  Returns -1 if the session has no retries left.
+ */
+int
+relay_connect_failed(struct rsession *con)
+{
+	struct relay	*rlay = con->se_relay;
+	struct timeval	 tv;
+	u_int		 ms;
+
+	if (con->se_host != NULL)
+		__sync_fetch_and_add(&host_counters(env,
+		    con->se_host->conf.id)->hc_connfail, 1);
+	relay_host_outlier(con, 1);
+	relay_host_release(con);
+
+	if (con->se_out.s != -1) {
+		event_del(&con->se_ev);
+		close(con->se_out.s);
+		con->se_out.s = -1;
+#ifndef __FreeBSD__ /* file descriptor accounting */
+		/* The session is in flight again until it reconnects */
+		relay_inflight++;
+#endif
+	}
+
+	/* The bindany socket cannot be reused for another attempt */
+	if (con->se_retry <= 0 || rlay->rl_conf.fwdmode == FWD_TRANS)
+		return (-1);
+	con->se_retry--;
+
+	ms = RELAY_BACKOFF_MIN << MIN(con->se_connretry, 8);
+	if (ms > RELAY_BACKOFF_MAX)
+		ms = RELAY_BACKOFF_MAX;
+	con->se_connretry++;
+
+	log_debug("%s: session %d: retry %d in %ums, %s", __func__,
+	    con->se_id, con->se_connretry, ms,
+	    con->se_retry ? "next retry" : "last retry");
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	evtimer_set(&con->se_ev, relay_connect_next, con);
+	evtimer_add(&con->se_ev, &tv);
+
+	return (0);
+}
+
+void
+relay_connect_next(int fd, short sig, void *arg)
+{
+	struct rsession	*con = arg;
+
+	if (relay_connect(con) == -1)
+		relay_abort_http(con, 502, "session failed", 0);
+}
+
+/*
+ * Idle backend connections are kept per relay and handed out to new
+ * sessions that are forwarded to the same host and port.
+ */
+int
+relay_backend_get(struct rsession *con)
+{
+	struct relay		*rlay = con->se_relay;
+	struct relay_backend	*rb;
+
+	if (rlay->rl_conf.fwdmode == FWD_TRANS)
+		return (-1);
+
+	TAILQ_FOREACH(rb, &rlay->rl_backends, rb_entry) {
+		if (rb->rb_port == con->se_out.port &&
+		    sockaddr_cmp((struct sockaddr *)&rb->rb_ss,
+		    (struct sockaddr *)&con->se_out.ss, -1) == 0)
+			break;
+	}
+	if (rb == NULL)
+		return (-1);
+
+	TAILQ_REMOVE(&rlay->rl_backends, rb, rb_entry);
+	event_del(&rb->rb_ev);
+	rlay->rl_counters->rc_backends--;
+
+	con->se_out.s = rb->rb_s;
+	if ((con->se_out.ssl = rb->rb_ssl) != NULL)
+		SSL_set_app_data(con->se_out.ssl, &con->se_out);
+	free(rb);
+
+	DPRINTF("%s: session %d: reusing backend connection %d",
+	    __func__, con->se_id, con->se_out.s);
+
+	return (0);
+}
+
+/*
+ * Called when a response is complete or the session is closed; returns
+ * 0 if the backend connection was taken over by the pool and must not
+ * be closed.
+ */
+int
+relay_backend_put(struct rsession *con)
+{
+	struct relay		*rlay = con->se_relay;
+	struct relay_backend	*rb;
+	struct timeval		 tv;
+	u_int			 n = 0;
+
+	if (rlay->rl_conf.keepalive == 0 ||
+	    rlay->rl_conf.fwdmode == FWD_TRANS ||
+	    rlay->rl_proto->type != RELAY_PROTO_HTTP ||
+	    con->se_out.s == -1 || !relay_http_reusable(con))
+		return (-1);
+	if (con->se_out.ssl != NULL && SSL_pending(con->se_out.ssl))
+		return (-1);
+
+	/* Limit the number of idle connections per backend */
+	TAILQ_FOREACH(rb, &rlay->rl_backends, rb_entry) {
+		if (rb->rb_port == con->se_out.port &&
+		    sockaddr_cmp((struct sockaddr *)&rb->rb_ss,
+		    (struct sockaddr *)&con->se_out.ss, -1) == 0 &&
+		    ++n >= rlay->rl_conf.keepalive)
+			return (-1);
+	}
+
+	if ((rb = calloc(1, sizeof(*rb))) == NULL)
+		return (-1);
+	rb->rb_relay = rlay;
+	bcopy(&con->se_out.ss, &rb->rb_ss, sizeof(rb->rb_ss));
+	rb->rb_port = con->se_out.port;
+	rb->rb_s = con->se_out.s;
+	rb->rb_ssl = con->se_out.ssl;
+
+	/* Drop the connection if the server closes it or sends data */
+	event_set(&rb->rb_ev, rb->rb_s, EV_READ, relay_backend_idle, rb);
+	bcopy(&rlay->rl_conf.keepalive_timeout, &tv, sizeof(tv));
+	event_add(&rb->rb_ev, &tv);
+
+	TAILQ_INSERT_HEAD(&rlay->rl_backends, rb, rb_entry);
+	rlay->rl_counters->rc_backends++;
+
+	con->se_out.s = -1;
+	con->se_out.ssl = NULL;
+
+	return (0);
+}
+
+/*
+ * Return the backend connection to the pool once every request of the
+ * session has got its response.  The next request connects again and
+ * takes an idle connection from the pool, not necessarily this one.
+ */
+int
+relay_backend_release(struct rsession *con)
+{
+	struct ctl_relay_event	*out = &con->se_out;
+	struct evbuffer		*output;
+
+	if (con->se_relay->rl_conf.keepalive == 0 || out->bev == NULL ||
+	    !relay_http_reusable(con))
+		return (-1);
+
+	/* The output buffer is shared with the buffer event */
+	if ((output = pool_evbuffer_get()) == NULL)
+		return (-1);
+	if (relay_backend_put(con) == -1) {
+		pool_evbuffer_put(output);
+		return (-1);
+	}
+
+	DPRINTF("%s: session %d: released backend connection", __func__,
+	    con->se_id);
+
+	pool_bufferevent_free(out->bev);
+	out->bev = NULL;
+	out->output = output;
+
+	relay_host_release(con);
+	con->se_connretry = 0;
+#ifndef __FreeBSD__ /* file descriptor accounting */
+	/* The session is in flight again until the next request */
+	relay_inflight++;
+#endif
+
+	return (0);
+}
+
+void
+relay_backend_idle(int fd, short event, void *arg)
+{
+	struct relay_backend	*rb = arg;
+
+	DPRINTF("%s: relay %s: closing idle backend connection %d (%s)",
+	    __func__, rb->rb_relay->rl_conf.name, fd,
+	    event & EV_TIMEOUT ? "timeout" : "closed");
+
+	TAILQ_REMOVE(&rb->rb_relay->rl_backends, rb, rb_entry);
+	relay_backend_free(rb);
+}
+
+void
+relay_backend_free(struct relay_backend *rb)
+{
+	event_del(&rb->rb_ev);
+	rb->rb_relay->rl_counters->rc_backends--;
+	if (rb->rb_ssl != NULL) {
+		/* XXX handle non-blocking shutdown */
+		if (SSL_shutdown(rb->rb_ssl) == 0)
+			SSL_shutdown(rb->rb_ssl);
+		SSL_free(rb->rb_ssl);
+	}
+	close(rb->rb_s);
+	free(rb);
+}
+
+void
+relay_backend_purge(struct relay *rlay)
+{
+	struct relay_backend	*rb;
+
+	while ((rb = TAILQ_FIRST(&rlay->rl_backends)) != NULL) {
+		TAILQ_REMOVE(&rlay->rl_backends, rb, rb_entry);
+		relay_backend_free(rb);
+	}
+}
+
+/*
+ * Classify the reason for closing a session by its log message; the
+ * sessions that saw the end of one of their peers have finished.
+ */
+enum relay_closetype
+relay_closetype(struct rsession *con, const char *msg)
+{
+	if (msg == NULL || con->se_done || strcmp(msg, "closed") == 0 ||
+	    strcmp(msg, "session closed") == 0)
+		return (RELAY_CLOSE_DONE);
+	if (strstr(msg, "timeout") != NULL || strstr(msg, "timed out") != NULL)
+		return (RELAY_CLOSE_TIMEOUT);
+	return (RELAY_CLOSE_ERROR);
+}
+
 void
 relay_close(struct rsession *con, const char *msg)
 {
 	char		 ibuf[128], obuf[128], *ptr = NULL;
 	struct relay	*rlay = con->se_relay;
 	struct protocol	*proto = rlay->rl_proto;
+	struct timeval	 tv;
 
-	SPLAY_REMOVE(session_tree, &rlay->rl_sessions, con);
+	session_remove(rlay, con);
+	relay_timer_del(con);
+	relay_host_release(con);
+
+	getmonotime(&tv);
+	timersub(&tv, &con->se_tv_accept, &tv);
+	relay_latency_add(con, LATENCY_SESSION, &tv);
 
 	event_del(&con->se_ev);
 	if (con->se_in.bev != NULL)
 		bufferevent_disable(con->se_in.bev, EV_READ|EV_WRITE);
 	if (con->se_out.bev != NULL)
 		bufferevent_disable(con->se_out.bev, EV_READ|EV_WRITE);
+#ifdef RELAY_SPLICE
+	(void)relay_spliceadjust(&con->se_in);
+	(void)relay_spliceadjust(&con->se_out);
+#endif
+#ifdef RELAY_SPLICE_PIPE
+	relay_splice_close(&con->se_in);
+	relay_splice_close(&con->se_out);
+#endif
+
+	rlay->rl_counters->rc_requests += con->se_in.requests;
+	rlay->rl_counters->rc_bytes_in += con->se_in.bytes;
+	rlay->rl_counters->rc_bytes_out += con->se_out.bytes;
+	rlay->rl_counters->rc_closes[relay_closetype(con, msg)]++;
 
 	if ((env->sc_opts & RELAYD_OPT_LOGUPDATE) && msg != NULL) {
 		bzero(&ibuf, sizeof(ibuf));
@@ -1669,27 +3039,51 @@ relay_close(struct rsession *con, const char *msg)
 			ptr = evbuffer_readline(con->se_log);
 		log_info("relay %s, "
 		    "session %d (%d active), %s, %s -> %s:%d, "
+		    "%llu/%llu bytes, %u requests, "
 #ifndef __FreeBSD__
 		    "%s%s%s", rlay->rl_conf.name, con->se_id, relay_sessions,
 #else
 		    "%s%s%s", rlay->rl_conf.name, con->se_id, (int)relay_sessions,
 #endif
 		    con->se_tag != 0 ? tag_id2name(con->se_tag) : "0", ibuf,
-		    obuf, ntohs(con->se_out.port), msg, ptr == NULL ? "" : ",",
+		    obuf, ntohs(con->se_out.port),
+		    (unsigned long long)con->se_in.bytes,
+		    (unsigned long long)con->se_out.bytes,
+		    con->se_in.requests, msg, ptr == NULL ? "" : ",",
 		    ptr == NULL ? "" : ptr);
 		if (ptr != NULL)
 			free(ptr);
 	}
 
+#ifndef __FreeBSD__ /* file descriptor accounting */
+	if (con->se_in.s != -1 && con->se_out.s == -1) {
+		/*
+		 * the output was never connected,
+		 * thus this was an inflight session.
+		 */
+		relay_inflight--;
+		log_debug("%s: sessions inflight decremented, now %d",
+		    __func__, relay_inflight);
+	}
+#endif
+
+	/*
+	 * Keep the backend connection open for the next session.  This
+	 * looks at the buffer events of both sides, so it has to be done
+	 * before any of them is freed.
+	 */
+	(void)relay_backend_put(con);
+
 	if (proto->close != NULL)
 		(*proto->close)(con);
 
 	if (con->se_priv != NULL)
 		free(con->se_priv);
-	if (con->se_in.bev != NULL)
-		bufferevent_free(con->se_in.bev);
-	else if (con->se_in.output != NULL)
-		evbuffer_free(con->se_in.output);
+	if (con->se_in.bev != NULL) {
+		pool_bufferevent_free(con->se_in.bev);
+		con->se_in.bev = NULL;
+	} else if (con->se_in.output != NULL)
+		pool_evbuffer_put(con->se_in.output);
 	if (con->se_in.ssl != NULL) {
 		/* XXX handle non-blocking shutdown */
 		if (SSL_shutdown(con->se_in.ssl) == 0)
@@ -1698,27 +3092,16 @@ relay_close(struct rsession *con, const char *msg)
 	}
 	if (con->se_in.sslcert != NULL)
 		X509_free(con->se_in.sslcert);
-	if (con->se_in.s != -1) {
+	if (con->se_in.s != -1)
 		close(con->se_in.s);
-#ifndef __FreeBSD__ /* file descriptor accounting */
-		if (con->se_out.s == -1) {
-			/*
-			 * the output was never connected,
-			 * thus this was an inflight session.
-			 */
-			relay_inflight--;
-			log_debug("%s: sessions inflight decremented, now %d",
-			    __func__, relay_inflight);
-		}
-#endif
-	}
 	if (con->se_in.buf != NULL)
 		free(con->se_in.buf);
 
-	if (con->se_out.bev != NULL)
-		bufferevent_free(con->se_out.bev);
-	else if (con->se_out.output != NULL)
-		evbuffer_free(con->se_out.output);
+	if (con->se_out.bev != NULL) {
+		pool_bufferevent_free(con->se_out.bev);
+		con->se_out.bev = NULL;
+	} else if (con->se_out.output != NULL)
+		pool_evbuffer_put(con->se_out.output);
 	if (con->se_out.ssl != NULL) {
 		/* XXX handle non-blocking shutdown */
 		if (SSL_shutdown(con->se_out.ssl) == 0)
@@ -1741,7 +3124,7 @@ relay_close(struct rsession *con, const char *msg)
 		free(con->se_out.buf);
 
 	if (con->se_log != NULL)
-		evbuffer_free(con->se_log);
+		pool_evbuffer_put(con->se_log);
 
 	if (con->se_cnl != NULL) {
 #if 0
@@ -1751,8 +3134,14 @@ relay_close(struct rsession *con, const char *msg)
 		free(con->se_cnl);
 	}
 
-	free(con);
+	pool_put(&relay_session_pool, con);
 	relay_sessions--;
+
+	/* Resume accepting if the session limit paused the listener. */
+	if (evtimer_pending(&rlay->rl_evt, NULL) && !relay_session_full(rlay)) {
+		evtimer_del(&rlay->rl_evt);
+		event_add(&rlay->rl_ev, NULL);
+	}
 }
 
 int
@@ -1765,6 +3154,7 @@ relay_dispatch_pfe(int fd, struct privsep_proc *p, struct imsg *imsg)
 	struct host		*host;
 	struct table		*table;
 	struct ctl_status	 st;
+	struct ctl_weight	 cw;
 	objid_t			 id;
 	int			 cid;
 
@@ -1779,14 +3169,52 @@ relay_dispatch_pfe(int fd, struct privsep_proc *p, struct imsg *imsg)
 		if (host->up == HOST_UP)
 			table->up--;
 		host->flags |= F_DISABLE;
+		host->flags &= ~F_EJECTED;
 		host->up = HOST_UNKNOWN;
+		relay_host_slowstart(table, host, 0);
+		relay_table_update(table, host, 0);
 		break;
 	case IMSG_HOST_ENABLE:
 		memcpy(&id, imsg->data, sizeof(id));
 		if ((host = host_find(env, id)) == NULL)
 			fatalx("relay_dispatch_pfe: desynchronized");
+		if ((table = table_find(env, host->conf.tableid)) ==
+		    NULL)
+			fatalx("relay_dispatch_pfe: invalid table id");
 		host->flags &= ~(F_DISABLE);
 		host->up = HOST_UNKNOWN;
+		/* The ramp starts when the host is enabled again */
+		relay_host_slowstart(table, host, 1);
+		relay_table_update(table, host, 0);
+		break;
+	case IMSG_HOST_WEIGHT:
+		IMSG_SIZE_CHECK(imsg, &cw);
+		memcpy(&cw, imsg->data, sizeof(cw));
+		if ((host = host_find(env, cw.id.id)) == NULL)
+			fatalx("relay_dispatch_pfe: desynchronized");
+		if ((table = table_find(env, host->conf.tableid)) ==
+		    NULL)
+			fatalx("relay_dispatch_pfe: invalid table id");
+		host->conf.weight = cw.weight;
+		relay_table_update(table, host, 1);
+		break;
+	case IMSG_HOST_EJECT:
+	case IMSG_HOST_READMIT:
+		IMSG_SIZE_CHECK(imsg, &id);
+		memcpy(&id, imsg->data, sizeof(id));
+		if ((host = host_find(env, id)) == NULL)
+			fatalx("relay_dispatch_pfe: desynchronized");
+		if ((table = table_find(env, host->conf.tableid)) ==
+		    NULL)
+			fatalx("relay_dispatch_pfe: invalid table id");
+		if (imsg->hdr.type == IMSG_HOST_EJECT) {
+			host->flags |= F_EJECTED;
+			relay_host_slowstart(table, host, 0);
+		} else {
+			host->flags &= ~F_EJECTED;
+			relay_host_slowstart(table, host, 1);
+		}
+		relay_table_update(table, host, 0);
 		break;
 	case IMSG_TABLE_DISABLE:
 		memcpy(&id, imsg->data, sizeof(id));
@@ -1796,6 +3224,7 @@ relay_dispatch_pfe(int fd, struct privsep_proc *p, struct imsg *imsg)
 		table->up = 0;
 		TAILQ_FOREACH(host, &table->hosts, entry)
 			host->up = HOST_UNKNOWN;
+		relay_table_update(table, NULL, 0);
 		break;
 	case IMSG_TABLE_ENABLE:
 		memcpy(&id, imsg->data, sizeof(id));
@@ -1805,6 +3234,7 @@ relay_dispatch_pfe(int fd, struct privsep_proc *p, struct imsg *imsg)
 		table->up = 0;
 		TAILQ_FOREACH(host, &table->hosts, entry)
 			host->up = HOST_UNKNOWN;
+		relay_table_update(table, NULL, 0);
 		break;
 	case IMSG_HOST_STATUS:
 		IMSG_SIZE_CHECK(imsg, &st);
@@ -1836,7 +3266,12 @@ relay_dispatch_pfe(int fd, struct privsep_proc *p, struct imsg *imsg)
 			table->up++;
 		else
 			table->up--;
+		if (st.up != HOST_UP)
+			relay_host_slowstart(table, host, 0);
+		else if (host->up == HOST_DOWN)
+			relay_host_slowstart(table, host, 1);
 		host->up = st.up;
+		relay_table_update(table, host, 0);
 		break;
 	case IMSG_NATLOOK:
 		bcopy(imsg->data, &cnl, sizeof(cnl));
@@ -1856,8 +3291,7 @@ relay_dispatch_pfe(int fd, struct privsep_proc *p, struct imsg *imsg)
 		IMSG_SIZE_CHECK(imsg, &cid);
 		memcpy(&cid, imsg->data, sizeof(cid));
 		TAILQ_FOREACH(rlay, env->sc_relays, rl_entry) {
-			SPLAY_FOREACH(con, session_tree,
-			    &rlay->rl_sessions) {
+			TAILQ_FOREACH(con, &rlay->rl_sessions, se_entry) {
 				memcpy(&se, con, sizeof(se));
 				se.se_cid = cid;
 				proc_compose_imsg(env->sc_ps, p->p_id, -1,
@@ -2036,6 +3470,114 @@ relay_ssl_callback_dh(SSL *ssl, int export, int keylen)
 	return (dh);
 }
 
+/*
+ * The shared SSL session cache is a fixed table of encoded sessions in
+ * memory shared by all relay processes, indexed by the session id.
+ * A new session replaces the previous one in its slot.  The internal
+ * cache of every process stays in front of it.
+ */
+struct ssl_cacheslot *
+relay_ssl_sess_lock(const unsigned char *id, u_int idlen)
+{
+	struct ssl_cacheslot	*slot;
+
+	slot = &env->sc_sslcache[hash32_buf(id, idlen, HASHINIT) %
+	    RELAY_SSLCACHE_SLOTS];
+	while (__sync_lock_test_and_set(&slot->cs_lock, 1))
+		;
+	return (slot);
+}
+
+void
+relay_ssl_sess_unlock(struct ssl_cacheslot *slot)
+{
+	__sync_lock_release(&slot->cs_lock);
+}
+
+int
+relay_ssl_sess_new(SSL *ssl, SSL_SESSION *sess)
+{
+	struct ssl_cacheslot	*slot;
+	const unsigned char	*id;
+	unsigned char		 buf[RELAY_SSLCACHE_SESSLEN], *p;
+	u_int			 idlen;
+	int			 len;
+
+	id = SSL_SESSION_get_id(sess, &idlen);
+	if (idlen == 0 || idlen > RELAY_SSLCACHE_IDLEN)
+		return (0);
+	if ((len = i2d_SSL_SESSION(sess, NULL)) <= 0 ||
+	    len > RELAY_SSLCACHE_SESSLEN)
+		return (0);
+
+	/* Encode outside of the lock, it is only held to copy the slot */
+	p = buf;
+	if (i2d_SSL_SESSION(sess, &p) != len)
+		goto done;
+
+	slot = relay_ssl_sess_lock(id, idlen);
+	memcpy(slot->cs_data, buf, len);
+	memcpy(slot->cs_id, id, idlen);
+	slot->cs_idlen = idlen;
+	slot->cs_len = len;
+	relay_ssl_sess_unlock(slot);
+
+ done:
+	bzero(buf, sizeof(buf));
+
+	/* The session is not referenced by the cache */
+	return (0);
+}
+
+SSL_SESSION *
+relay_ssl_sess_get(SSL *ssl, unsigned char *id, int idlen, int *copy)
+{
+	struct ssl_cacheslot	*slot;
+	SSL_SESSION		*sess = NULL;
+	unsigned char		 buf[RELAY_SSLCACHE_SESSLEN];
+	const unsigned char	*p;
+	size_t			 len = 0;
+
+	*copy = 0;
+	if (idlen <= 0 || idlen > RELAY_SSLCACHE_IDLEN)
+		return (NULL);
+
+	slot = relay_ssl_sess_lock(id, idlen);
+	if (slot->cs_idlen == (u_int)idlen &&
+	    memcmp(slot->cs_id, id, idlen) == 0) {
+		len = slot->cs_len;
+		memcpy(buf, slot->cs_data, len);
+	}
+	relay_ssl_sess_unlock(slot);
+
+	if (len == 0)
+		return (NULL);
+
+	/* Decode outside of the lock */
+	p = buf;
+	sess = d2i_SSL_SESSION(NULL, &p, len);
+	bzero(buf, len);
+
+	return (sess);
+}
+
+void
+relay_ssl_sess_remove(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+	struct ssl_cacheslot	*slot;
+	const unsigned char	*id;
+	u_int			 idlen;
+
+	id = SSL_SESSION_get_id(sess, &idlen);
+	if (idlen == 0 || idlen > RELAY_SSLCACHE_IDLEN)
+		return;
+
+	slot = relay_ssl_sess_lock(id, idlen);
+	if (slot->cs_idlen == idlen && memcmp(slot->cs_id, id, idlen) == 0)
+		slot->cs_idlen = 0;
+	relay_ssl_sess_unlock(slot);
+}
+
 SSL_CTX *
 relay_ssl_ctx_create(struct relay *rlay)
 {
@@ -2056,6 +3598,13 @@ relay_ssl_ctx_create(struct relay *rlay)
 		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
 		if (proto->cache >= 0)
 			SSL_CTX_sess_set_cache_size(ctx, proto->cache);
+
+		/* Share the sessions with the other relay processes */
+		if (env->sc_sslcache != NULL) {
+			SSL_CTX_sess_set_new_cb(ctx, relay_ssl_sess_new);
+			SSL_CTX_sess_set_get_cb(ctx, relay_ssl_sess_get);
+			SSL_CTX_sess_set_remove_cb(ctx, relay_ssl_sess_remove);
+		}
 	}
 
 	/* Enable all workarounds and set SSL options */
@@ -2605,6 +4154,41 @@ relay_bufferevent_write(struct ctl_relay_event *cre, void *data, size_t size)
 	return (bufferevent_write(cre->bev, data, size));
 }
 
+/*
+ * Stop reading from this side of the session while the peer has more
+ * than the high watermark queued for output.  relay_write() resumes
+ * reading once the peer buffer has drained to the low watermark.
+ */
+int
+relay_bufferevent_pressure(struct ctl_relay_event *cre)
+{
+	struct rsession		*con = cre->con;
+	struct relay		*rlay = con->se_relay;
+	struct evbuffer		*dst;
+	size_t			 len;
+
+	/* The backend connection has been released */
+	if (cre->bev == NULL)
+		return (0);
+
+	if (cre->dst->bev != NULL)
+		dst = EVBUFFER_OUTPUT(cre->dst->bev);
+	else if ((dst = cre->dst->output) == NULL)
+		return (0);
+
+	len = EVBUFFER_LENGTH(dst);
+	if (len > con->se_maxbuf)
+		con->se_maxbuf = len;
+	if (len >= rlay->rl_conf.bufhigh) {
+		DPRINTF("%s: session %d: dir %d, %lu bytes buffered",
+		    __func__, con->se_id, cre->dir, len);
+		bufferevent_disable(cre->bev, EV_READ);
+		return (1);
+	}
+	bufferevent_enable(cre->bev, EV_READ);
+	return (0);
+}
+
 int
 relay_cmp_af(struct sockaddr_storage *a, struct sockaddr_storage *b)
 {
@@ -2747,18 +4331,6 @@ relay_load_certfiles(struct relay *rlay)
 	return (0);
 }
 
-int
-relay_session_cmp(struct rsession *a, struct rsession *b)
-{
-	struct relay	*rlay = b->se_relay;
-	struct protocol	*proto = rlay->rl_proto;
-
-	if (proto != NULL && proto->cmp != NULL)
-		return ((*proto->cmp)(a, b));
-
-	return ((int)a->se_id - b->se_id);
-}
-
 void
 relay_log(struct rsession *con, char *msg)
 {
@@ -2766,5 +4338,3 @@ relay_log(struct rsession *con, char *msg)
 		evbuffer_add(con->se_log, msg, strlen(msg));
 	}
 }
-
-SPLAY_GENERATE(session_tree, rsession, se_nodes, relay_session_cmp);
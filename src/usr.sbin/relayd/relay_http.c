@@ -21,6 +21,7 @@
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/tree.h>
 #include <sys/hash.h>
@@ -48,6 +49,15 @@
 #include "relayd.h"
 #include "http.h"
 
+/* Pieces of the HTTP header that is being serialized */
+#define HTTP_IOVMAX	64
+struct http_iov {
+	struct ctl_relay_event	*hi_dst;
+	struct iovec		 hi_iov[HTTP_IOVMAX];
+	u_int			 hi_cnt;
+	size_t			 hi_len;
+};
+
 static int	_relay_lookup_url(struct ctl_relay_event *, char *, char *,
 		    char *, struct kv *);
 int		 relay_lookup_url(struct ctl_relay_event *,
@@ -59,13 +69,15 @@ void		 relay_read_httpcontent(struct bufferevent *, void *);
 void		 relay_read_httpchunks(struct bufferevent *, void *);
 char		*relay_expand_http(struct ctl_relay_event *, char *,
 		    char *, size_t);
-int		 relay_writeheader_kv(struct ctl_relay_event *, struct kv *);
-int		 relay_writeheader_http(struct ctl_relay_event *,
+int		 relay_writeheader_kv(struct http_iov *, struct kv *);
+int		 relay_writeheader_http(struct http_iov *,
 		    struct ctl_relay_event *);
-int		 relay_writerequest_http(struct ctl_relay_event *,
+int		 relay_writerequest_http(struct http_iov *,
 		    struct ctl_relay_event *);
-int		 relay_writeresponse_http(struct ctl_relay_event *,
+int		 relay_writeresponse_http(struct http_iov *,
 		    struct ctl_relay_event *);
+int		 relay_writeiov_http(struct http_iov *, int);
+int		 relay_http_iov(struct http_iov *, const char *);
 void		 relay_reset_http(struct ctl_relay_event *);
 static int	 relay_httpmethod_cmp(const void *, const void *);
 static int	 relay_httperror_cmp(const void *, const void *);
@@ -83,9 +95,12 @@ int		 relay_apply_actions(struct ctl_relay_event *, struct kvlist *);
 int		 relay_match_actions(struct ctl_relay_event *,
 		    struct relay_rule *, struct kvlist *, struct kvlist *);
 void		 relay_httpdesc_free(struct http_descriptor *);
+int		 relay_http_keepalive(struct http_descriptor *);
 
 static struct relayd	*env = NULL;
 
+struct pool		 relay_httpdesc_pool;
+
 static struct http_method	 http_methods[] = HTTP_METHODS;
 static struct http_error	 http_errors[] = HTTP_ERRORS;
 
@@ -111,6 +126,10 @@ relay_http_init(struct relay *rlay)
 {
 	rlay->rl_proto->close = relay_close_http;
 
+	if (relay_httpdesc_pool.pl_items == NULL)
+		pool_init(&relay_httpdesc_pool, "httpdesc",
+		    sizeof(struct http_descriptor), RELAY_POOL_MAX * 2);
+
 	relay_http(NULL);
 
 	/* Calculate skip step for the filter rules (may take a while) */
@@ -122,7 +141,7 @@ relay_httpdesc_init(struct ctl_relay_event *cre)
 {
 	struct http_descriptor	*desc;
 
-	if ((desc = calloc(1, sizeof(*desc))) == NULL)
+	if ((desc = pool_get(&relay_httpdesc_pool)) == NULL)
 		return (-1);
 
 	RB_INIT(&desc->http_headers);
@@ -166,6 +185,7 @@ relay_read_http(struct bufferevent *bev, void *arg)
 	struct relay		*rlay = con->se_relay;
 	struct protocol		*proto = rlay->rl_proto;
 	struct evbuffer		*src = EVBUFFER_INPUT(bev);
+	struct http_iov		 hi;
 	char			*line = NULL, *key, *value;
 	int			 action;
 	const char		*errstr;
@@ -174,6 +194,7 @@ relay_read_http(struct bufferevent *bev, void *arg)
 
 	getmonotime(&con->se_tv_last);
 	cre->timedout = 0;
+	relay_host_sample(cre);
 
 	size = EVBUFFER_LENGTH(src);
 	DPRINTF("%s: session %d: size %lu, to read %lld",
@@ -277,6 +298,9 @@ relay_read_http(struct bufferevent *bev, void *arg)
 			DPRINTF("http_version %s http_rescode %s "
 			    "http_resmesg %s", desc->http_version,
 			    desc->http_rescode, desc->http_resmesg);
+			/* Server errors count for the passive checks */
+			relay_host_outlier(con,
+			    strtonum(desc->http_rescode, 100, 999, NULL) >= 500);
 			goto lookup;
 		} else if (cre->line == 1 && cre->dir == RELAY_DIR_REQUEST) {
 			if ((desc->http_method = relay_httpmethod_byname(key))
@@ -355,7 +379,9 @@ relay_read_http(struct bufferevent *bev, void *arg)
 
 		free(line);
 	}
+	cre->bytes += size - EVBUFFER_LENGTH(src);
 	if (cre->done) {
+		cre->requests++;
 		if (desc->http_method == HTTP_METHOD_NONE) {
 			relay_abort_http(con, 406, "no method", 0);
 			return;
@@ -407,16 +433,29 @@ relay_read_http(struct bufferevent *bev, void *arg)
 			bev->readcb = relay_read_httpchunks;
 		}
 
+		hi.hi_dst = cre->dst;
+		hi.hi_cnt = 0;
+		hi.hi_len = 0;
 		if (cre->dir == RELAY_DIR_REQUEST) {
-			if (relay_writerequest_http(cre->dst, cre) == -1)
+			if (relay_writerequest_http(&hi, cre) == -1)
 			    goto fail;
+			con->se_keepalive = relay_http_keepalive(desc);
+			con->se_pending++;
 		} else {
-			if (relay_writeresponse_http(cre->dst, cre) == -1)
+			if (relay_writeresponse_http(&hi, cre) == -1)
 			    goto fail;
+			/* Informational 1xx responses precede the final one */
+			if (*desc->http_rescode != '1') {
+				con->se_keepalive &=
+				    relay_http_keepalive(desc);
+				if (con->se_pending > 0)
+					con->se_pending--;
+			}
 		}
-		if (relay_bufferevent_print(cre->dst, "\r\n") == -1 ||
-		    relay_writeheader_http(cre->dst, cre) == -1 ||
-		    relay_bufferevent_print(cre->dst, "\r\n") == -1)
+		if (relay_http_iov(&hi, "\r\n") == -1 ||
+		    relay_writeheader_http(&hi, cre) == -1 ||
+		    relay_http_iov(&hi, "\r\n") == -1 ||
+		    relay_writeiov_http(&hi, 1) == -1)
 			goto fail;
 
 		relay_reset_http(cre);
@@ -438,11 +477,15 @@ relay_read_http(struct bufferevent *bev, void *arg)
 	}
 	if (EVBUFFER_LENGTH(src) && bev->readcb != relay_read_http)
 		bev->readcb(bev, arg);
-	bufferevent_enable(bev, EV_READ);
-#ifndef __FreeBSD__
-	if (relay_splice(cre) == -1)
+	relay_bufferevent_pressure(cre);
+#ifdef RELAY_SPLICE
+	if (relay_splice(cre) == -1) {
 		relay_close(con, strerror(errno));
+		return;
+	}
 #endif
+	if (cre->dir == RELAY_DIR_RESPONSE)
+		(void)relay_backend_release(con);
 	return;
  fail:
 	relay_abort_http(con, 500, strerror(errno), 0);
@@ -451,6 +494,56 @@ relay_read_http(struct bufferevent *bev, void *arg)
 	free(line);
 }
 
+/*
+ * Check if the connection may stay open after this message, following
+ * the persistent connection rules of HTTP/1.0 and HTTP/1.1.
+ */
+int
+relay_http_keepalive(struct http_descriptor *desc)
+{
+	struct kv	 key, *conn;
+
+	key.kv_key = "Connection";
+	conn = kv_find(&desc->http_headers, &key);
+
+	if (desc->http_version != NULL &&
+	    strcmp(desc->http_version, "HTTP/1.1") == 0)
+		return (conn == NULL ||
+		    strcasecmp(conn->kv_value, "close") != 0);
+
+	return (conn != NULL && strcasecmp(conn->kv_value, "keep-alive") == 0);
+}
+
+/*
+ * A backend connection can be passed on to another session if every
+ * request got its complete response and neither side asked to close.
+ */
+int
+relay_http_reusable(struct rsession *con)
+{
+	struct ctl_relay_event	*in = &con->se_in, *out = &con->se_out;
+
+	if (!con->se_keepalive || con->se_pending)
+		return (0);
+	if (in->bev == NULL || out->bev == NULL)
+		return (0);
+
+	/* Both directions must be waiting for the next HTTP header */
+	if (in->bev->readcb != relay_read_http ||
+	    out->bev->readcb != relay_read_http ||
+	    in->toread > 0 || out->toread > 0 || out->line != 0)
+		return (0);
+	if (in->splicelen >= 0 || out->splicelen >= 0)
+		return (0);
+
+	/* Nothing must be left in the buffers of the backend connection */
+	if (EVBUFFER_LENGTH(out->bev->input) ||
+	    EVBUFFER_LENGTH(out->bev->output))
+		return (0);
+
+	return (1);
+}
+
 void
 relay_read_httpcontent(struct bufferevent *bev, void *arg)
 {
@@ -467,7 +560,7 @@ relay_read_httpcontent(struct bufferevent *bev, void *arg)
 	    con->se_id, size, cre->toread);
 	if (!size)
 		return;
-#ifndef __FreeBSD__
+#ifdef RELAY_SPLICE
 	if (relay_spliceadjust(cre) == -1)
 		goto fail;
 #endif
@@ -485,6 +578,7 @@ relay_read_httpcontent(struct bufferevent *bev, void *arg)
 				goto fail;
 			cre->toread -= size;
 		}
+		cre->bytes += size;
 		DPRINTF("%s: done, size %lu, to read %lld", __func__,
 		    size, cre->toread);
 	}
@@ -496,7 +590,9 @@ relay_read_httpcontent(struct bufferevent *bev, void *arg)
 		goto done;
 	if (bev->readcb != relay_read_httpcontent)
 		bev->readcb(bev, arg);
-	bufferevent_enable(bev, EV_READ);
+	relay_bufferevent_pressure(cre);
+	if (cre->dir == RELAY_DIR_RESPONSE)
+		(void)relay_backend_release(con);
 	return;
  done:
 	relay_close(con, "last http content read");
@@ -523,7 +619,7 @@ relay_read_httpchunks(struct bufferevent *bev, void *arg)
 	    con->se_id, size, cre->toread);
 	if (!size)
 		return;
-#ifndef __FreeBSD__
+#ifdef RELAY_SPLICE
 	if (relay_spliceadjust(cre) == -1)
 		goto fail;
 #endif
@@ -541,9 +637,11 @@ relay_read_httpchunks(struct bufferevent *bev, void *arg)
 				goto fail;
 			cre->toread -= size;
 		}
+		cre->bytes += size;
 		DPRINTF("%s: done, size %lu, to read %lld", __func__,
 		    size, cre->toread);
 	}
+	size = EVBUFFER_LENGTH(src);
 	switch (cre->toread) {
 	case TOREAD_HTTP_CHUNK_LENGTH:
 		line = evbuffer_readline(src);
@@ -611,11 +709,14 @@ relay_read_httpchunks(struct bufferevent *bev, void *arg)
 	}
 
  next:
+	cre->bytes += size - EVBUFFER_LENGTH(src);
 	if (con->se_done)
 		goto done;
 	if (EVBUFFER_LENGTH(src))
 		bev->readcb(bev, arg);
-	bufferevent_enable(bev, EV_READ);
+	relay_bufferevent_pressure(cre);
+	if (cre->dir == RELAY_DIR_RESPONSE)
+		(void)relay_backend_release(con);
 	return;
 
  done:
@@ -984,7 +1085,7 @@ relay_close_http(struct rsession *con)
 		if (desc[i] == NULL)
 			continue;
 		relay_httpdesc_free(desc[i]);
-		free(desc[i]);
+		pool_put(&relay_httpdesc_pool, desc[i]);
 	}
 }
 
@@ -1050,9 +1151,64 @@ relay_expand_http(struct ctl_relay_event *cre, char *val, char *buf,
 #endif
 }
 
+/*
+ * The start line and the headers of a message are collected as a list
+ * of strings on the stack of relay_read_http() and copied into the
+ * output buffer by relay_writeiov_http(), which grows the buffer once
+ * and schedules a single write.
+ */
+int
+relay_http_iov(struct http_iov *hi, const char *str)
+{
+	struct iovec	*iov;
+
+	/* Flush the pieces collected so far, very long headers only */
+	if (hi->hi_cnt >= HTTP_IOVMAX && relay_writeiov_http(hi, 0) == -1)
+		return (-1);
+
+	iov = &hi->hi_iov[hi->hi_cnt++];
+	iov->iov_base = (void *)str;
+	iov->iov_len = strlen(str);
+	hi->hi_len += iov->iov_len;
+
+	return (0);
+}
+
+int
+relay_writeiov_http(struct http_iov *hi, int last)
+{
+	struct ctl_relay_event	*dst = hi->hi_dst;
+	struct evbuffer		*buf;
+	struct iovec		*iov;
+	u_int			 i;
+	int			 ret = 0;
+
+	buf = dst->bev != NULL ? EVBUFFER_OUTPUT(dst->bev) : dst->output;
+
+	/* Make room for all the pieces at once */
+	if (evbuffer_expand(buf, hi->hi_len) == -1) {
+		ret = -1;
+		goto done;
+	}
+
+	for (i = 0; i < hi->hi_cnt && ret != -1; i++) {
+		iov = &hi->hi_iov[i];
+		/* The last piece of the header schedules the write */
+		if (last && i == hi->hi_cnt - 1 && dst->bev != NULL)
+			ret = bufferevent_write(dst->bev, iov->iov_base,
+			    iov->iov_len);
+		else
+			ret = evbuffer_add(buf, iov->iov_base, iov->iov_len);
+	}
+
+ done:
+	hi->hi_cnt = 0;
+	hi->hi_len = 0;
+	return (ret);
+}
+
 int
-relay_writerequest_http(struct ctl_relay_event *dst,
-    struct ctl_relay_event *cre)
+relay_writerequest_http(struct http_iov *hi, struct ctl_relay_event *cre)
 {
 	struct http_descriptor	*desc = (struct http_descriptor *)cre->desc;
 	const char		*name = NULL;
@@ -1060,40 +1216,39 @@ relay_writerequest_http(struct ctl_relay_event *dst,
 	if ((name = relay_httpmethod_byid(desc->http_method)) == NULL)
 		return (-1);
 
-	if (relay_bufferevent_print(dst, name) == -1 ||
-	    relay_bufferevent_print(dst, " ") == -1 ||
-	    relay_bufferevent_print(dst, desc->http_path) == -1 ||
+	if (relay_http_iov(hi, name) == -1 ||
+	    relay_http_iov(hi, " ") == -1 ||
+	    relay_http_iov(hi, desc->http_path) == -1 ||
 	    (desc->http_query != NULL &&
-	    (relay_bufferevent_print(dst, "?") == -1 ||
-	    relay_bufferevent_print(dst, desc->http_query) == -1)) ||
-	    relay_bufferevent_print(dst, " ") == -1 ||
-	    relay_bufferevent_print(dst, desc->http_version) == -1)
+	    (relay_http_iov(hi, "?") == -1 ||
+	    relay_http_iov(hi, desc->http_query) == -1)) ||
+	    relay_http_iov(hi, " ") == -1 ||
+	    relay_http_iov(hi, desc->http_version) == -1)
 		return (-1);
 
 	return (0);
 }
 
 int
-relay_writeresponse_http(struct ctl_relay_event *dst,
-    struct ctl_relay_event *cre)
+relay_writeresponse_http(struct http_iov *hi, struct ctl_relay_event *cre)
 {
 	struct http_descriptor	*desc = (struct http_descriptor *)cre->desc;
 
 	DPRINTF("version: %s rescode: %s resmsg: %s", desc->http_version,
 	    desc->http_rescode, desc->http_resmesg);
 
-	if (relay_bufferevent_print(dst, desc->http_version) == -1 ||
-	    relay_bufferevent_print(dst, " ") == -1 ||
-	    relay_bufferevent_print(dst, desc->http_rescode) == -1 ||
-	    relay_bufferevent_print(dst, " ") == -1 ||
-	    relay_bufferevent_print(dst, desc->http_resmesg) == -1)
+	if (relay_http_iov(hi, desc->http_version) == -1 ||
+	    relay_http_iov(hi, " ") == -1 ||
+	    relay_http_iov(hi, desc->http_rescode) == -1 ||
+	    relay_http_iov(hi, " ") == -1 ||
+	    relay_http_iov(hi, desc->http_resmesg) == -1)
 		return (-1);
 
 	return (0);
 }
 
 int
-relay_writeheader_kv(struct ctl_relay_event *dst, struct kv *hdr)
+relay_writeheader_kv(struct http_iov *hi, struct kv *hdr)
 {
 	char			*ptr;
 	const char		*key;
@@ -1108,11 +1263,11 @@ relay_writeheader_kv(struct ctl_relay_event *dst, struct kv *hdr)
 		key = hdr->kv_key;
 
 	ptr = hdr->kv_value;
-	if (relay_bufferevent_print(dst, key) == -1 ||
+	if (relay_http_iov(hi, key) == -1 ||
 	    (ptr != NULL &&
-	    (relay_bufferevent_print(dst, ": ") == -1 ||
-	    relay_bufferevent_print(dst, ptr) == -1 ||
-	    relay_bufferevent_print(dst, "\r\n") == -1)))
+	    (relay_http_iov(hi, ": ") == -1 ||
+	    relay_http_iov(hi, ptr) == -1 ||
+	    relay_http_iov(hi, "\r\n") == -1)))
 		return (-1);
 	DPRINTF("%s: %s: %s", __func__, key,
 	    hdr->kv_value == NULL ? "" : hdr->kv_value);
@@ -1121,17 +1276,16 @@ relay_writeheader_kv(struct ctl_relay_event *dst, struct kv *hdr)
 }
 
 int
-relay_writeheader_http(struct ctl_relay_event *dst, struct ctl_relay_event
-    *cre)
+relay_writeheader_http(struct http_iov *hi, struct ctl_relay_event *cre)
 {
 	struct kv		*hdr, *kv;
 	struct http_descriptor	*desc = (struct http_descriptor *)cre->desc;
 
 	RB_FOREACH(hdr, kvtree, &desc->http_headers) {
-		if (relay_writeheader_kv(dst, hdr) == -1)
+		if (relay_writeheader_kv(hi, hdr) == -1)
 			return (-1);
 		TAILQ_FOREACH(kv, &hdr->kv_children, kv_entry) {
-			if (relay_writeheader_kv(dst, kv) == -1)
+			if (relay_writeheader_kv(hi, kv) == -1)
 				return (-1);
 		}
 	}
@@ -71,7 +71,7 @@ void		*relay_dns_validate(struct rsession *,
 int		 relay_dns_request(struct rsession *);
 void		 relay_udp_response(int, short, void *);
 void		 relay_dns_result(struct rsession *, u_int8_t *, size_t);
-int		 relay_dns_cmp(struct rsession *, struct rsession *);
+u_int32_t	 relay_dns_key(struct rsession *);
 
 void
 relay_udp_privinit(struct relayd *x_env, struct relay *rlay)
@@ -93,7 +93,7 @@ relay_udp_init(struct relay *rlay)
 	case RELAY_PROTO_DNS:
 		proto->validate = relay_dns_validate;
 		proto->request = relay_dns_request;
-		proto->cmp = relay_dns_cmp;
+		proto->key = relay_dns_key;
 		shuffle_init(&relay_shuffle);
 		break;
 	default:
@@ -190,8 +190,7 @@ relay_udp_response(int fd, short sig, void *arg)
 		return;
 	}
 
-	if (relay_sessions >= RELAY_MAX_SESSIONS ||
-	    rlay->rl_conf.flags & F_DISABLE)
+	if (rlay->rl_conf.flags & F_DISABLE)
 		return;
 
 	slen = sizeof(ss);
@@ -224,10 +223,16 @@ relay_udp_server(int fd, short sig, void *arg)
 	ssize_t len;
 
 	event_add(&rlay->rl_ev, NULL);
+	if (sig == EV_TIMEOUT)
+		return;
 
-	if (relay_sessions >= RELAY_MAX_SESSIONS ||
-	    rlay->rl_conf.flags & F_DISABLE)
+	if (rlay->rl_conf.flags & F_DISABLE)
+		return;
+	if (relay_session_full(rlay)) {
+		/* Leave the requests queued in the socket buffer */
+		relay_accept_pause(rlay);
 		return;
+	}
 
 	slen = sizeof(ss);
 	if ((len = recvfrom(fd, buf, sizeof(buf), 0,
@@ -238,7 +243,7 @@ relay_udp_server(int fd, short sig, void *arg)
 	    (priv = (*proto->validate)(NULL, rlay, &ss, buf, len)) == NULL)
 		return;
 
-	if ((con = calloc(1, sizeof(*con))) == NULL) {
+	if ((con = pool_get(&relay_session_pool)) == NULL) {
 		free(priv);
 		return;
 	}
@@ -253,12 +258,20 @@ relay_udp_server(int fd, short sig, void *arg)
 	con->se_out.dst = &con->se_in;
 	con->se_in.con = con;
 	con->se_out.con = con;
+#ifdef RELAY_SPLICE_PIPE
+	con->se_in.splicepipe[0] = con->se_in.splicepipe[1] = -1;
+	con->se_out.splicepipe[0] = con->se_out.splicepipe[1] = -1;
+#endif
 	con->se_relay = rlay;
 	con->se_id = ++relay_conid;
 	con->se_in.dir = RELAY_DIR_REQUEST;
 	con->se_out.dir = RELAY_DIR_RESPONSE;
 	con->se_retry = rlay->rl_conf.dstretry;
 	con->se_out.port = rlay->rl_conf.dstport;
+	if (proto->key != NULL) {
+		con->se_key = (*proto->key)(con);
+		con->se_haskey = 1;
+	}
 	switch (ss.ss_family) {
 	case AF_INET:
 		con->se_in.port = ((struct sockaddr_in *)&ss)->sin_port;
@@ -271,15 +284,17 @@ relay_udp_server(int fd, short sig, void *arg)
 
 	getmonotime(&con->se_tv_start);
 	bcopy(&con->se_tv_start, &con->se_tv_last, sizeof(con->se_tv_last));
+	con->se_tv_accept = con->se_tv_start;
 
 	relay_sessions++;
-	SPLAY_INSERT(session_tree, &rlay->rl_sessions, con);
+	session_insert(rlay, con);
+	relay_timer_add(con);
 
 	/* Increment the per-relay session counter */
-	rlay->rl_stats[proc_id].last++;
+	stat_session(rlay->rl_counters, con->se_tv_start.tv_sec);
 
 	/* Pre-allocate output buffer */
-	con->se_out.output = evbuffer_new();
+	con->se_out.output = pool_evbuffer_get();
 	if (con->se_out.output == NULL) {
 		relay_close(con, "failed to allocate output buffer");
 		return;
@@ -287,7 +302,7 @@ relay_udp_server(int fd, short sig, void *arg)
 
 	/* Pre-allocate log buffer */
 	con->se_haslog = 0;
-	con->se_log = evbuffer_new();
+	con->se_log = pool_evbuffer_get();
 	if (con->se_log == NULL) {
 		relay_close(con, "failed to allocate log buffer");
 		return;
@@ -307,6 +322,7 @@ relay_udp_server(int fd, short sig, void *arg)
 			free(cnl);
 		return;
 	}
+	con->se_in.bytes += len;
 
 	if (cnl != NULL) {
 		con->se_cnl = cnl;
@@ -403,9 +419,8 @@ relay_dns_validate(struct rsession *con, struct relay *rlay,
     struct sockaddr_storage *ss, u_int8_t *buf, size_t len)
 {
 	struct relay_dnshdr	*hdr = (struct relay_dnshdr *)buf;
-	struct rsession		 lookup;
 	u_int16_t		 key;
-	struct relay_dns_priv	*priv, lpriv;
+	struct relay_dns_priv	*priv;
 
 	/* Validate the header length */
 	if (len < sizeof(*hdr))
@@ -431,10 +446,7 @@ relay_dns_validate(struct rsession *con, struct relay *rlay,
 	 * remote host matches the original destination of the request.
 	 */
 	if (con == NULL) {
-		lpriv.dp_inkey = key;
-		lookup.se_priv = &lpriv;
-		if ((con = SPLAY_FIND(session_tree,
-		    &rlay->rl_sessions, &lookup)) != NULL &&
+		if ((con = session_findbykey(rlay, key)) != NULL &&
 		    con->se_priv != NULL &&
 		    relay_cmp_af(ss, &con->se_out.ss) == 0)
 			relay_dns_result(con, buf, len);
@@ -519,6 +531,7 @@ relay_dns_result(struct rsession *con, u_int8_t *buf, size_t len)
 
 	if (priv == NULL)
 		fatalx("relay_dns_result: response to invalid session");
+	con->se_out.bytes += len;
 
 	if (debug)
 		relay_dns_log(con, buf, len);
@@ -539,14 +552,13 @@ relay_dns_result(struct rsession *con, u_int8_t *buf, size_t len)
 	relay_close(con, "session closed");
 }
 
-int
-relay_dns_cmp(struct rsession *a, struct rsession *b)
+u_int32_t
+relay_dns_key(struct rsession *con)
 {
-	struct relay_dns_priv	*ap = a->se_priv;
-	struct relay_dns_priv	*bp = b->se_priv;
+	struct relay_dns_priv	*priv = con->se_priv;
 
-	if (ap == NULL || bp == NULL)
-		fatalx("relay_dns_cmp: invalid session");
+	if (priv == NULL)
+		fatalx("relay_dns_key: invalid session");
 
-	return (memcmp(&ap->dp_inkey, &bp->dp_inkey, sizeof(u_int16_t)));
+	return (priv->dp_inkey);
 }
@@ -25,6 +25,7 @@
 #endif
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
 #include <sys/hash.h>
@@ -33,6 +34,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -70,6 +72,9 @@ int		 parent_dispatch_relay(int, struct privsep_proc *,
 int		 parent_dispatch_ca(int, struct privsep_proc *,
 		    struct imsg *);
 int		 bindany(struct ctl_bindany *);
+void		 stat_bucket_add(struct stat_bucket *, u_int, u_int32_t);
+u_int32_t	 stat_bucket_sum(struct stat_bucket *, u_int, u_int32_t);
+u_int		 latency_bucket(u_int32_t);
 
 struct relayd			*relayd_env;
 
@@ -226,6 +231,20 @@ main(int argc, char *argv[])
 	if ((ps->ps_pw =  getpwnam(RELAYD_USER)) == NULL)
 		errx(1, "unknown user %s", RELAYD_USER);
 
+	/*
+	 * Load the full configuration before forking, the shared
+	 * counters are sized from its hosts and relays.
+	 */
+	if (load_config(env->sc_conffile, env) == -1)
+		exit(1);
+
+	if (env->sc_opts & RELAYD_OPT_NOACTION) {
+		fprintf(stderr, "configuration OK\n");
+		exit(0);
+	}
+
+	stat_slots(env);
+
 	/* Configure the control socket */
 	ps->ps_csock.cs_name = RELAYD_SOCKET;
 
@@ -235,10 +254,7 @@ main(int argc, char *argv[])
 	if (!debug && daemon(1, 0) == -1)
 		err(1, "failed to daemonize");
 
-	if (env->sc_opts & RELAYD_OPT_NOACTION)
-		ps->ps_noaction = 1;
-	else
-		log_info("startup");
+	log_info("startup");
 
 #ifdef __FreeBSD__
 #if __FreeBSD_version > 1000002
@@ -249,11 +265,30 @@ main(int argc, char *argv[])
 #endif
 #endif
 
+	/* Statistics counters shared by the relay processes and the pfe */
+	if ((env->sc_hoststats = shared_calloc(env->sc_hostslots,
+	    sizeof(*env->sc_hoststats))) == NULL)
+		fatal("failed to allocate shared host counters");
+	if ((env->sc_relaystats = shared_calloc(env->sc_relayslots *
+	    RELAY_MAXPROC, sizeof(*env->sc_relaystats))) == NULL)
+		fatal("failed to allocate shared relay counters");
+	if ((env->sc_relaylatency = shared_calloc(env->sc_relayslots,
+	    sizeof(*env->sc_relaylatency))) == NULL ||
+	    (env->sc_hostlatency = shared_calloc(env->sc_hostslots,
+	    sizeof(*env->sc_hostlatency))) == NULL)
+		fatal("failed to allocate shared latency histograms");
+
+	/* SSL session cache shared by the relay processes */
+	if ((env->sc_sslcache = shared_calloc(RELAY_SSLCACHE_SLOTS,
+	    sizeof(*env->sc_sslcache))) == NULL)
+		fatal("failed to allocate shared SSL session cache");
+
 	ps->ps_instances[PROC_RELAY] = env->sc_prefork_relay;
 	ps->ps_instances[PROC_CA] = env->sc_prefork_relay;
 	ps->ps_ninstances = env->sc_prefork_relay;
 
 	proc_init(ps, procs, nitems(procs));
+	sslcache_unmap(env);
 
 	setproctitle("parent");
 
@@ -273,17 +308,6 @@ main(int argc, char *argv[])
 
 	proc_listen(ps, procs, nitems(procs));
 
-	if (load_config(env->sc_conffile, env) == -1) {
-		proc_kill(env->sc_ps);
-		exit(1);
-	}
-
-	if (env->sc_opts & RELAYD_OPT_NOACTION) {
-		fprintf(stderr, "configuration OK\n");
-		proc_kill(env->sc_ps);
-		exit(0);
-	}
-
 	if (env->sc_flags & (F_SSL|F_SSLCLIENT))
 		ssl_init(env);
 
@@ -387,9 +411,16 @@ parent_reload(struct relayd *env, u_int reset, const char *filename)
 	config_purge(env, CONFIG_ALL);
 
 	if (reset == CONFIG_RELOAD) {
+		/*
+		 * The children are only reset once the new configuration
+		 * has been loaded, they keep running the old one otherwise.
+		 */
 		if (load_config(filename, env) == -1) {
-			log_debug("%s: failed to load config file %s",
+			log_warnx("%s: failed to load config file %s, "
+			    "keeping the running configuration",
 			    __func__, filename);
+			config_purge(env, CONFIG_ALL);
+			return;
 		}
 
 		config_setreset(env, CONFIG_ALL);
@@ -414,6 +445,12 @@ parent_configure_done(struct relayd *env)
 
 	env->sc_reload--;
 	if (env->sc_reload == 0) {
+		/*
+		 * All children have dropped the old sessions and loaded the
+		 * new config, the ids are about to be reused.
+		 */
+		stat_reset(env);
+
 		for (id = 0; id < PROC_MAX; id++) {
 			if (id == privsep_process)
 				continue;
@@ -591,6 +628,8 @@ purge_table(struct tablelist *head, struct table *table)
 			ibuf_free(host->cte.buf);
 		if (host->cte.ssl != NULL)
 			SSL_free(host->cte.ssl);
+		if (evtimer_initialized(&host->slowstart_ev))
+			evtimer_del(&host->slowstart_ev);
 		free(host);
 	}
 	if (table->sendbuf != NULL)
@@ -630,13 +669,15 @@ purge_relay(struct relayd *env, struct relay *rlay)
 	/* shutdown and remove relay */
 	if (event_initialized(&rlay->rl_ev))
 		event_del(&rlay->rl_ev);
-	close(rlay->rl_s);
+	if (rlay->rl_s != -1)
+		close(rlay->rl_s);
 	TAILQ_REMOVE(env->sc_relays, rlay, rl_entry);
 
 	/* cleanup sessions */
 	while ((con =
-	    SPLAY_ROOT(&rlay->rl_sessions)) != NULL)
+	    TAILQ_FIRST(&rlay->rl_sessions)) != NULL)
 		relay_close(con, NULL);
+	relay_backend_purge(rlay);
 
 	/* cleanup relay */
 	if (rlay->rl_bev != NULL)
@@ -671,6 +712,11 @@ purge_relay(struct relayd *env, struct relay *rlay)
 
 	while ((rlt = TAILQ_FIRST(&rlay->rl_tables))) {
 		TAILQ_REMOVE(&rlay->rl_tables, rlt, rlt_entry);
+		free(rlt->rlt_host);
+		free(rlt->rlt_weight);
+		free(rlt->rlt_up);
+		free(rlt->rlt_uppos);
+		free(rlt->rlt_lookup);
 		free(rlt);
 	}
 
@@ -1122,16 +1168,126 @@ proto_find(struct relayd *env, objid_t id)
 	return (NULL);
 }
 
+/*
+ * The sessions of a relay process are indexed by id and, if the
+ * protocol provides one, by a lookup key like the DNS request id.
+ * The hash tables double in size whenever they get as many entries
+ * as buckets; the relays keep a list of their sessions for iteration.
+ */
+static struct session_index	 session_ids;
+static struct session_index	 session_keys;
+
+static u_int
+session_hash(struct rsession *con, int bykey)
+{
+	if (bykey)
+		return (hash32_buf(&con->se_key, sizeof(con->se_key),
+		    con->se_relay->rl_conf.id));
+	return (con->se_id);
+}
+
+static void
+session_index_resize(struct session_index *si, int bykey)
+{
+	struct sessionbucket	*buckets;
+	struct rsession		*con;
+	u_int			 size, i, h;
+
+	size = si->si_size ? si->si_size * 2 : SESSION_INDEX_MIN;
+	if ((buckets = calloc(size, sizeof(*buckets))) == NULL) {
+		if (si->si_size == 0)
+			fatal("session_index_resize");
+		/* keep the current table, lookups will just be slower */
+		return;
+	}
+	for (i = 0; i < size; i++)
+		LIST_INIT(&buckets[i]);
+
+	for (i = 0; i < si->si_size; i++) {
+		while ((con = LIST_FIRST(&si->si_buckets[i])) != NULL) {
+			h = session_hash(con, bykey) & (size - 1);
+			if (bykey) {
+				LIST_REMOVE(con, se_keynode);
+				LIST_INSERT_HEAD(&buckets[h], con, se_keynode);
+			} else {
+				LIST_REMOVE(con, se_idnode);
+				LIST_INSERT_HEAD(&buckets[h], con, se_idnode);
+			}
+		}
+	}
+
+	free(si->si_buckets);
+	si->si_buckets = buckets;
+	si->si_size = size;
+}
+
+void
+session_insert(struct relay *rlay, struct rsession *con)
+{
+	u_int	 h;
+
+	TAILQ_INSERT_TAIL(&rlay->rl_sessions, con, se_entry);
+	rlay->rl_nsessions++;
+
+	if (session_ids.si_count >= session_ids.si_size)
+		session_index_resize(&session_ids, 0);
+	h = session_hash(con, 0) & (session_ids.si_size - 1);
+	LIST_INSERT_HEAD(&session_ids.si_buckets[h], con, se_idnode);
+	session_ids.si_count++;
+
+	if (!con->se_haskey)
+		return;
+	if (session_keys.si_count >= session_keys.si_size)
+		session_index_resize(&session_keys, 1);
+	h = session_hash(con, 1) & (session_keys.si_size - 1);
+	LIST_INSERT_HEAD(&session_keys.si_buckets[h], con, se_keynode);
+	session_keys.si_count++;
+}
+
+void
+session_remove(struct relay *rlay, struct rsession *con)
+{
+	TAILQ_REMOVE(&rlay->rl_sessions, con, se_entry);
+	rlay->rl_nsessions--;
+
+	LIST_REMOVE(con, se_idnode);
+	session_ids.si_count--;
+
+	if (con->se_haskey) {
+		LIST_REMOVE(con, se_keynode);
+		session_keys.si_count--;
+	}
+}
+
 struct rsession *
 session_find(struct relayd *env, objid_t id)
 {
-	struct relay		*rlay;
 	struct rsession		*con;
 
-	TAILQ_FOREACH(rlay, env->sc_relays, rl_entry)
-		SPLAY_FOREACH(con, session_tree, &rlay->rl_sessions)
-			if (con->se_id == id)
-				return (con);
+	if (session_ids.si_size == 0)
+		return (NULL);
+	LIST_FOREACH(con,
+	    &session_ids.si_buckets[id & (session_ids.si_size - 1)],
+	    se_idnode)
+		if (con->se_id == id)
+			return (con);
+	return (NULL);
+}
+
+struct rsession *
+session_findbykey(struct relay *rlay, u_int32_t key)
+{
+	struct rsession		*con;
+	u_int			 h;
+
+	if (session_keys.si_size == 0)
+		return (NULL);
+	h = hash32_buf(&key, sizeof(key), rlay->rl_conf.id);
+	LIST_FOREACH(con,
+	    &session_keys.si_buckets[h & (session_keys.si_size - 1)],
+	    se_keynode)
+		if (con->se_relay == rlay && con->se_key == key)
+			return (con);
 	return (NULL);
 }
 
@@ -1518,7 +1674,7 @@ map4to6(struct sockaddr_storage *in4, struct sockaddr_storage *map)
 	return (0);
 }
 
-void
+int
 socket_rlimit(int maxfd)
 {
 	struct rlimit	 rl;
@@ -1542,6 +1698,293 @@ socket_rlimit(int maxfd)
 		rl.rlim_cur = MAX(rl.rlim_max, (rlim_t)maxfd);
 	if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
 		fatal("socket_rlimit: failed to set resource limit");
+
+	return (rl.rlim_cur > INT_MAX ? INT_MAX : (int)rl.rlim_cur);
+}
+
+/*
+ * Allocate zeroed memory that stays shared with the forked children.
+ */
+void *
+shared_calloc(size_t nmemb, size_t size)
+{
+	void	*p;
+
+	p = mmap(NULL, nmemb * size, PROT_READ|PROT_WRITE,
+	    MAP_ANON|MAP_SHARED, -1, 0);
+	if (p == MAP_FAILED)
+		return (NULL);
+	return (p);
+}
+
+void
+shared_free(void *p, size_t nmemb, size_t size)
+{
+	if (p != NULL && munmap(p, nmemb * size) == -1)
+		fatal("shared_free");
+}
+
+/*
+ * The shared SSL session cache holds the master secrets of the client
+ * sessions, only the relay processes keep it mapped.
+ */
+void
+sslcache_unmap(struct relayd *env)
+{
+	shared_free(env->sc_sslcache, RELAY_SSLCACHE_SLOTS,
+	    sizeof(*env->sc_sslcache));
+	env->sc_sslcache = NULL;
+}
+
+/*
+ * The ids start at 1, the first slot of each region is left for ids
+ * that do not fit.  load_config() refuses such configurations, this
+ * only keeps a desynchronized process from writing past the regions.
+ */
+struct relay_counters *
+relay_counters(struct relayd *env, objid_t id, int proc)
+{
+	if (id >= env->sc_relayslots)
+		id = 0;
+	return (&env->sc_relaystats[id * RELAY_MAXPROC + proc]);
+}
+
+struct host_counters *
+host_counters(struct relayd *env, objid_t id)
+{
+	if (id >= env->sc_hostslots)
+		id = 0;
+	return (&env->sc_hoststats[id]);
+}
+
+/*
+ * The shared counters are indexed by the ids of the hosts and relays.
+ * They are sized for twice the ids of the configuration at startup to
+ * leave room for configurations that grow on reload; load_config()
+ * refuses a configuration that does not fit.
+ */
+void
+stat_slots(struct relayd *env)
+{
+	struct table	*table;
+	struct host	*host;
+	struct relay	*rlay;
+	u_int		 hosts = 0, relays = 0;
+
+	TAILQ_FOREACH(table, env->sc_tables, entry)
+		TAILQ_FOREACH(host, &table->hosts, entry)
+			hosts = MAX(hosts, host->conf.id);
+	TAILQ_FOREACH(rlay, env->sc_relays, rl_entry)
+		relays = MAX(relays, rlay->rl_conf.id);
+
+	env->sc_hostslots = MAX((hosts + 1) * 2, RELAY_MINSLOTS);
+	env->sc_relayslots = MAX((relays + 1) * 2, RELAY_MINSLOTS);
+}
+
+/*
+ * Clear the shared counters.  The ids of the relays and hosts restart
+ * with every new configuration, the new objects must not inherit the
+ * totals and active sessions of the old ones.
+ */
+void
+stat_reset(struct relayd *env)
+{
+	bzero(env->sc_hoststats, env->sc_hostslots *
+	    sizeof(*env->sc_hoststats));
+	bzero(env->sc_relaystats, env->sc_relayslots * RELAY_MAXPROC *
+	    sizeof(*env->sc_relaystats));
+	bzero(env->sc_relaylatency, env->sc_relayslots *
+	    sizeof(*env->sc_relaylatency));
+	bzero(env->sc_hostlatency, env->sc_hostslots *
+	    sizeof(*env->sc_hostlatency));
+}
+
+void
+stat_bucket_add(struct stat_bucket *ring, u_int n, u_int32_t t)
+{
+	struct stat_bucket	*sb = &ring[t % n];
+
+	if (sb->sb_stamp != t) {
+		sb->sb_cnt = 0;
+		sb->sb_stamp = t;
+	}
+	sb->sb_cnt++;
+}
+
+u_int32_t
+stat_bucket_sum(struct stat_bucket *ring, u_int n, u_int32_t t)
+{
+	u_int32_t	 sum = 0;
+	u_int		 i;
+
+	/* Sum up the buckets of the last n periods before t */
+	for (i = 0; i < n; i++)
+		if (t - ring[i].sb_stamp - 1 < n)
+			sum += ring[i].sb_cnt;
+	return (sum);
+}
+
+/*
+ * Count a new session of a relay, called by the relay process with the
+ * monotonic start time of the session.
+ */
+void
+stat_session(struct relay_counters *rc, time_t now)
+{
+	if (rc->rc_start == 0)
+		rc->rc_start = now;
+	rc->rc_sessions++;
+	stat_bucket_add(rc->rc_sec, RELAY_STATSECS, now);
+	stat_bucket_add(rc->rc_min, RELAY_STATMINS, now / 60);
+	stat_bucket_add(rc->rc_hour, RELAY_STATHOURS, now / 3600);
+}
+
+/*
+ * Read the counters of a relay process.  The last values are the sessions
+ * of the last complete second, minute, hour and day, the averages are
+ * taken over the time the relay has been running.
+ */
+void
+stat_relay(struct relay_counters *rc, struct ctl_stats *crs)
+{
+	struct stat_bucket	*sb;
+	struct timeval		 tv;
+	time_t			 now, elapsed;
+
+	getmonotime(&tv);
+	now = tv.tv_sec;
+	elapsed = rc->rc_start ? MAX(now - rc->rc_start, 1) : 1;
+
+	crs->interval = RELAY_STATSECS;
+	crs->cnt = rc->rc_sessions;
+	crs->overflows = rc->rc_overflows;
+	crs->accepts = rc->rc_accepts;
+	crs->limited = rc->rc_limited;
+	crs->rejects = rc->rc_rejects;
+	crs->requests = rc->rc_requests;
+	crs->bytes_in = rc->rc_bytes_in;
+	crs->bytes_out = rc->rc_bytes_out;
+	memcpy(crs->closes, rc->rc_closes, sizeof(crs->closes));
+	crs->backends = rc->rc_backends;
+
+	sb = &rc->rc_sec[(now - 1) % RELAY_STATSECS];
+	crs->last_sec = sb->sb_stamp == (u_int32_t)(now - 1) ? sb->sb_cnt : 0;
+	crs->last = stat_bucket_sum(rc->rc_sec, RELAY_STATSECS, now);
+	crs->last_hour = stat_bucket_sum(rc->rc_min, RELAY_STATMINS,
+	    now / 60);
+	crs->last_day = stat_bucket_sum(rc->rc_hour, RELAY_STATHOURS,
+	    now / 3600);
+
+	crs->avg = crs->last_hour * RELAY_STATSECS /
+	    MIN(MAX(elapsed, RELAY_STATSECS), 3600);
+	crs->avg_hour = crs->last_day * 3600 /
+	    MIN(MAX(elapsed, 3600), 86400);
+	crs->avg_day = crs->cnt * 86400 / MAX(elapsed, 86400);
+}
+
+struct latency_counters *
+latency_relay(struct relayd *env, objid_t id)
+{
+	if (id >= env->sc_relayslots)
+		id = 0;
+	return (&env->sc_relaylatency[id]);
+}
+
+struct latency_counters *
+latency_host(struct relayd *env, objid_t id)
+{
+	if (id >= env->sc_hostslots)
+		id = 0;
+	return (&env->sc_hostlatency[id]);
+}
+
+/*
+ * Values below 2^RELAY_HISTSUBBITS get their own bucket, larger values
+ * are split into 2^RELAY_HISTSUBBITS buckets per power of two, so the
+ * error of a bucket is at most 12.5%.
+ */
+u_int
+latency_bucket(u_int32_t us)
+{
+	u_int	 e;
+
+	if (us < (1 << RELAY_HISTSUBBITS))
+		return (us);
+	e = 31 - __builtin_clz(us);
+	return (((e - RELAY_HISTSUBBITS + 1) << RELAY_HISTSUBBITS) +
+	    ((us >> (e - RELAY_HISTSUBBITS)) &
+	    ((1 << RELAY_HISTSUBBITS) - 1)));
+}
+
+/*
+ * Return the highest value of a bucket.
+ */
+u_int32_t
+latency_value(u_int idx)
+{
+	u_int	 e, sub;
+
+	if (idx < (1 << RELAY_HISTSUBBITS))
+		return (idx);
+	e = (idx >> RELAY_HISTSUBBITS) + RELAY_HISTSUBBITS - 1;
+	sub = idx & ((1 << RELAY_HISTSUBBITS) - 1);
+	return (((((u_int64_t)1 << RELAY_HISTSUBBITS) + sub + 1) <<
+	    (e - RELAY_HISTSUBBITS)) - 1);
+}
+
+void
+latency_add(struct latency_counters *lc, enum latency_type type,
+    struct timeval *tv)
+{
+	u_int64_t	 us;
+
+	if (tv->tv_sec < 0)
+		return;
+	us = (u_int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+	if (us > 0xffffffff)
+		us = 0xffffffff;
+	__sync_fetch_and_add(&lc->lc_buckets[type][latency_bucket(us)], 1);
+	__sync_fetch_and_add(&lc->lc_sum[type], us);
+}
+
+/*
+ * Compute the sample counts and percentiles of the histograms, returns
+ * 0 if there are no samples at all.
+ */
+int
+latency_get(struct latency_counters *lc, struct ctl_latency *cl)
+{
+	static const u_int	 permille[LATENCY_NPCT] = { 500, 900, 990, 999 };
+	u_int64_t		 sum, rank;
+	u_int			 type, i, n;
+	int			 found = 0;
+
+	bzero(cl, sizeof(*cl));
+	for (type = 0; type < LATENCY_MAX; type++) {
+		for (i = 0; i < RELAY_HISTBUCKETS; i++)
+			cl->cnt[type] += lc->lc_buckets[type][i];
+		if (cl->cnt[type] == 0)
+			continue;
+		found = 1;
+
+		sum = 0;
+		n = 0;
+		for (i = 0; i < RELAY_HISTBUCKETS && n < LATENCY_NPCT; i++) {
+			sum += lc->lc_buckets[type][i];
+			while (n < LATENCY_NPCT) {
+				rank = (cl->cnt[type] * permille[n] + 999) /
+				    1000;
+				if (sum < rank)
+					break;
+				cl->pct[type][n++] = latency_value(i);
+			}
+		}
+		/* The buckets may have changed while reading them */
+		for (; n < LATENCY_NPCT; n++)
+			cl->pct[type][n] = latency_value(RELAY_HISTBUCKETS - 1);
+	}
+
+	return (found);
 }
 
 char *
@@ -67,15 +67,61 @@
 #define FD_RESERVE		5
 #endif
 
-#define RELAY_MAX_SESSIONS	1024
+/*
+ * Socket splicing: OpenBSD moves data between sockets in the kernel
+ * with SO_SPLICE, Linux can do the same with splice(2) through a
+ * per-session pipe pair.  Other systems copy through the evbuffers.
+ */
+#ifdef __linux__
+#define RELAY_SPLICE_PIPE
+#endif
+#if !defined(__FreeBSD__) || defined(RELAY_SPLICE_PIPE)
+#define RELAY_SPLICE
+#endif
+#define RELAY_SPLICE_CHUNK	65536
+
+#define RELAY_MAX_BACKLOG	1024
+#define RELAY_DEFER_ACCEPT	30	/* seconds to wait for client data */
+#ifdef RELAY_SPLICE_PIPE
+#define RELAY_SESSION_FDS	6	/* two sockets and two splice pipes */
+#else
+#define RELAY_SESSION_FDS	2	/* client and server socket */
+#endif
+#define RELAY_FD_RESERVE	32	/* descriptors not used for sessions */
+#define RELAY_POOL_MAX		1024	/* cached objects per pool */
+#define RELAY_POOL_BUFSIZ	16384	/* don't cache larger evbuffers */
+#define RELAY_BUFLIMIT		262144	/* per-direction buffer high mark */
 #define RELAY_TIMEOUT		600
+#define RELAY_KEEPALIVE_TIMEOUT	30	/* idle backend connections */
+#define RELAY_BACKOFF_MIN	50	/* first connect retry, in ms */
+#define RELAY_BACKOFF_MAX	2000
+#define RELAY_FAILOVER_MAX	2	/* implicit retries with a table */
 #define RELAY_CACHESIZE		-1	/* use default size */
 #define RELAY_NUMPROC		3
 #define RELAY_MAXPROC		32
-#define RELAY_MAXHOSTS		32
+#define RELAY_MAXHOSTS		8192	/* per relay table */
+#define RELAY_MAXWEIGHT		256
+#define RELAY_MINSLOTS		64	/* shared counters, see stat_slots() */
+#define RELAY_STATSECS		60	/* per-second buckets */
+#define RELAY_STATMINS		60	/* per-minute buckets */
+#define RELAY_STATHOURS		24	/* per-hour buckets */
+#define RELAY_HISTSUBBITS	3	/* 8 buckets per power of two */
+#define RELAY_HISTBUCKETS	((32 - RELAY_HISTSUBBITS + 1) << \
+				    RELAY_HISTSUBBITS)
+#define RELAY_SSLCACHE_SLOTS	1024	/* shared SSL session cache */
+#define RELAY_SSLCACHE_IDLEN	32	/* SSL_MAX_SSL_SESSION_ID_LENGTH */
+#define RELAY_SSLCACHE_SESSLEN	2048	/* max. encoded session size */
+#define RELAY_LOOKUP_SIZE	65521	/* consistent hash table, prime */
+#define RELAY_LOOKUP_EMPTY	0xffff
+#define RELAY_EWMA_DECAY	10000000 /* latency decay time, in us */
+#define RELAY_EWMA_PENALTY	1000000	/* cost of an unmeasured busy host */
+#define RELAY_SLOWSTART_SCALE	100	/* steps of the slow-start ramp */
+#define RELAY_EJECT_BACKOFF	30	/* seconds before readmission */
 #define RELAY_MAXHEADERLENGTH	8192
 #define RELAY_STATINTERVAL	60
+#define RELAY_TIMER_SLOTS	256	/* session timer wheel, 1s per slot */
 #define RELAY_BACKLOG		10
+#define RELAY_ACCEPTBATCH	1	/* connections accepted per wakeup */
 #define RELAY_MAXLOOKUPLEVELS	5
 #ifndef __FreeBSD__ /* file descriptor accounting */
 #define RELAY_OUTOF_FD_RETRIES	5
@@ -120,6 +166,17 @@ struct shuffle {
 	int		 isindex;
 };
 
+/* Per-process cache of recycled objects, see pool.c */
+struct pool {
+	const char	*pl_name;
+	size_t		 pl_size;
+	void		**pl_items;
+	u_int		 pl_nitems;
+	u_int		 pl_max;
+	u_int64_t	 pl_hits;
+	u_int64_t	 pl_misses;
+};
+
 typedef u_int32_t objid_t;
 
 struct ctl_flags {
@@ -132,6 +189,7 @@ struct ctl_status {
 	int		 up;
 	int		 retry_cnt;
 	u_long		 check_cnt;
+	u_int64_t	 duration;	/* of the last check, in us */
 	u_int16_t	 he;
 };
 
@@ -140,6 +198,11 @@ struct ctl_id {
 	char		 name[MAX_NAME_SIZE];
 };
 
+struct ctl_weight {
+	struct ctl_id	 id;
+	int		 weight;
+};
+
 struct ctl_relaytable {
 	objid_t		 id;
 	objid_t		 relayid;
@@ -210,6 +273,15 @@ struct ctl_relay_event {
 	enum sslreneg_state	 sslreneg_state;
 
 	off_t			 splicelen;
+#ifdef RELAY_SPLICE_PIPE
+	int			 splicepipe[2];
+	size_t			 splicepending;
+	off_t			 splicebytes;
+	off_t			 splicemax;
+	int			 spliceeof;
+	struct event		 splicerev;
+	struct event		 splicewev;
+#endif
 	off_t			 toread;
 	size_t			 headerlen;
 	int			 line;
@@ -217,6 +289,9 @@ struct ctl_relay_event {
 	int			 timedout;
 	enum direction		 dir;
 
+	u_int64_t		 bytes;		/* data read from this side */
+	u_int			 requests;	/* HTTP messages read */
+
 	u_int8_t		*buf;
 	int			 buflen;
 
@@ -262,6 +337,14 @@ struct ctl_keyop {
 	int			 cko_padding;
 };
 
+/* Reasons for closing a relay session, see relay_close() */
+enum relay_closetype {
+	RELAY_CLOSE_DONE = 0,	/* the peers have finished */
+	RELAY_CLOSE_TIMEOUT,	/* a timeout expired */
+	RELAY_CLOSE_ERROR,	/* all other failures */
+	RELAY_CLOSE_MAX
+};
+
 struct ctl_stats {
 	objid_t			 id;
 	int			 proc;
@@ -275,6 +358,17 @@ struct ctl_stats {
 	u_int32_t		 last_hour;
 	u_int32_t		 avg_day;
 	u_int32_t		 last_day;
+	u_int32_t		 last_sec;
+
+	u_int64_t		 overflows;	/* accept queue was full */
+	u_int64_t		 accepts;	/* connections accepted */
+	u_int64_t		 limited;	/* accepts paused at the limit */
+	u_int64_t		 rejects;	/* sessions refused */
+	u_int64_t		 requests;	/* HTTP requests relayed */
+	u_int64_t		 bytes_in;	/* data read from clients */
+	u_int64_t		 bytes_out;	/* data read from servers */
+	u_int64_t		 closes[RELAY_CLOSE_MAX];
+	u_int64_t		 backends;	/* idle backend connections */
 };
 
 enum key_option {
@@ -384,13 +478,15 @@ TAILQ_HEAD(addresslist, address);
 #define F_DIVERT		0x01000000
 #define F_SCRIPT		0x02000000
 #define F_SSLINSPECT		0x04000000
+#define F_REUSEPORT		0x08000000
+#define F_EJECTED		0x10000000
 
 #define F_BITS								\
 	"\10\01DISABLE\02BACKUP\03USED\04DOWN\05ADD\06DEL\07CHANGED"	\
 	"\10STICKY-ADDRESS\11CHECK_DONE\12ACTIVE_RULESET\13CHECK_SENT"	\
 	"\14SSL\15NAT_LOOKUP\16DEMOTE\17LOOKUP_PATH\20DEMOTED\21UDP"	\
 	"\22RETURN\23TRAP\24NEEDPF\25PORT\26SSL_CLIENT\27NEEDRT"	\
-	"\30MATCH\31DIVERT\32SCRIPT"
+	"\30MATCH\31DIVERT\32SCRIPT\33SSL_INSPECT\34REUSEPORT\35EJECTED"
 
 enum forwardmode {
 	FWD_NORMAL		= 0,
@@ -407,6 +503,7 @@ struct host_config {
 	struct sockaddr_storage	 ss;
 	int			 ttl;
 	int			 priority;
+	int			 weight;
 };
 
 struct host {
@@ -421,6 +518,15 @@ struct host {
 	u_long			 check_cnt;
 	u_long			 up_cnt;
 	int			 retry_cnt;
+	u_long			 connfail_cnt;
+	u_long			 session_cnt;
+	u_int64_t		 ewma_cost;	/* peak latency, in us */
+	struct timeval		 ewma_stamp;
+	struct timeval		 slowstart;	/* back in service since */
+	struct event		 slowstart_ev;
+	struct timeval		 eject_stamp;
+	u_long			 eject_cnt;
+	u_int64_t		 check_dur;	/* last check, in us */
 	int			 idx;
 	u_int16_t		 he;
 	struct ctl_tcp_event	 cte;
@@ -479,6 +585,9 @@ struct table_config {
 	char			 demote_group[IFNAMSIZ];
 	char			 ifname[IFNAMSIZ];
 	struct timeval		 timeout;
+	struct timeval		 slowstart;
+	int			 eject_errors;
+	struct timeval		 eject_backoff;
 	in_port_t		 port;
 	int			 retcode;
 	int			 skip_cnt;
@@ -544,10 +653,14 @@ struct rsession {
 	u_int32_t			 se_hashkey;
 	int				 se_hashkeyset;
 	struct relay_table		*se_table;
+	struct host			*se_host;
 	struct event			 se_ev;
 	struct timeval			 se_timeout;
 	struct timeval			 se_tv_start;
 	struct timeval			 se_tv_last;
+	struct timeval			 se_tv_accept;
+	struct timeval			 se_tv_connect;
+	struct timeval			 se_tv_request;
 #ifndef __FreeBSD__ /* file descriptor accounting */
 	struct event			 se_inflightevt;
 #endif
@@ -557,7 +670,15 @@ struct rsession {
 	int				 se_retrycount;
 #endif
 	int				 se_connectcount;
+	int				 se_connretry;
+	int				 se_hostheld;
+	u_int				 se_hostslot;
 	int				 se_haslog;
+	int				 se_haskey;
+	u_int32_t			 se_key;
+	int				 se_keepalive;
+	u_int				 se_pending;
+	size_t				 se_maxbuf;
 	struct evbuffer			*se_log;
 	struct relay			*se_relay;
 	struct ctl_natlook		*se_cnl;
@@ -567,9 +688,22 @@ struct rsession {
 
 	int				 se_cid;
 	pid_t				 se_pid;
-	SPLAY_ENTRY(rsession)		 se_nodes;
+	TAILQ_ENTRY(rsession)		 se_entry;
+	LIST_ENTRY(rsession)		 se_idnode;
+	LIST_ENTRY(rsession)		 se_keynode;
+	LIST_ENTRY(rsession)		 se_timernode;
+	int				 se_timerset;
+};
+TAILQ_HEAD(sessionlist, rsession);
+LIST_HEAD(sessionbucket, rsession);
+
+/* Hash index of the sessions in a relay process */
+struct session_index {
+	struct sessionbucket	*si_buckets;
+	u_int			 si_size;
+	u_int			 si_count;
 };
-SPLAY_HEAD(session_tree, rsession);
+#define SESSION_INDEX_MIN	256
 
 enum prototype {
 	RELAY_PROTO_TCP		= 0,
@@ -660,11 +794,14 @@ TAILQ_HEAD(relay_rules, relay_rule);
 #define TCPFLAG_IPTTL		0x20
 #define TCPFLAG_IPMINTTL	0x40
 #define TCPFLAG_NSPLICE		0x80
+#define TCPFLAG_FASTOPEN	0x100
+#define TCPFLAG_ACCEPTFILTER	0x200
 #define TCPFLAG_DEFAULT		0x00
 
 #define TCPFLAG_BITS						\
 	"\10\01NODELAY\02NO_NODELAY\03SACK\04NO_SACK"		\
-	"\05SOCKET_BUFFER_SIZE\06IP_TTL\07IP_MINTTL\10NO_SPLICE"
+	"\05SOCKET_BUFFER_SIZE\06IP_TTL\07IP_MINTTL\10NO_SPLICE"	\
+	"\11FASTOPEN\12ACCEPT_FILTER"
 
 #define SSLFLAG_SSLV2				0x01
 #define SSLFLAG_SSLV3				0x02
@@ -689,9 +826,11 @@ TAILQ_HEAD(relay_rules, relay_rule);
 struct protocol {
 	objid_t			 id;
 	u_int32_t		 flags;
-	u_int8_t		 tcpflags;
+	u_int16_t		 tcpflags;
 	int			 tcpbufsiz;
 	int			 tcpbacklog;
+	int			 tcpacceptbatch;
+	char			 tcpacceptfilter[16];
 	u_int8_t		 tcpipttl;
 	u_int8_t		 tcpipminttl;
 	u_int8_t		 sslflags;
@@ -707,7 +846,7 @@ struct protocol {
 	enum prototype		 type;
 	char			*style;
 
-	int			(*cmp)(struct rsession *, struct rsession *);
+	u_int32_t		(*key)(struct rsession *);
 	void			*(*validate)(struct rsession *, struct relay *,
 				    struct sockaddr_storage *,
 				    u_int8_t *, size_t);
@@ -726,12 +865,86 @@ struct relay_table {
 	u_int32_t		 rlt_flags;
 	int			 rlt_mode;
 	u_int32_t		 rlt_key;
-	struct host		*rlt_host[RELAY_MAXHOSTS];
+	struct host		**rlt_host;
 	int			 rlt_nhosts;
+	int			*rlt_weight;
+	int			*rlt_up;	/* indexes of active hosts */
+	int			*rlt_uppos;	/* position in rlt_up or -1 */
+	int			 rlt_nup;
+	u_int16_t		*rlt_lookup;	/* all hosts, then up hosts */
 	TAILQ_ENTRY(relay_table) rlt_entry;
 };
 TAILQ_HEAD(relaytables, relay_table);
 
+/*
+ * Statistics counters in memory shared with the relay processes.  The
+ * counters of a relay are only written by the relay process owning
+ * them, the counters of a host are updated atomically.
+ */
+struct stat_bucket {
+	u_int32_t		 sb_stamp;
+	u_int32_t		 sb_cnt;
+};
+
+struct relay_counters {
+	time_t			 rc_start;
+	u_int64_t		 rc_sessions;
+	u_int64_t		 rc_accepts;
+	u_int64_t		 rc_overflows;
+	u_int64_t		 rc_limited;
+	u_int64_t		 rc_rejects;
+	u_int64_t		 rc_requests;
+	u_int64_t		 rc_bytes_in;
+	u_int64_t		 rc_bytes_out;
+	u_int64_t		 rc_closes[RELAY_CLOSE_MAX];
+	u_int64_t		 rc_backends;
+	struct stat_bucket	 rc_sec[RELAY_STATSECS];
+	struct stat_bucket	 rc_min[RELAY_STATMINS];
+	struct stat_bucket	 rc_hour[RELAY_STATHOURS];
+};
+
+struct host_counters {
+	volatile u_int		 hc_active;
+	volatile u_long		 hc_sessions;
+	volatile u_long		 hc_connfail;
+	volatile u_long		 hc_failures;	/* failed sessions */
+	volatile u_int		 hc_errors;	/* consecutive failures */
+};
+
+/*
+ * Log-bucketed latency histograms in microseconds, updated atomically
+ * by all relay processes.
+ */
+enum latency_type {
+	LATENCY_ACCEPT = 0,	/* accept to backend connected */
+	LATENCY_CONNECT,	/* backend connect */
+	LATENCY_RESPONSE,	/* request to first response byte */
+	LATENCY_SESSION,	/* session duration */
+	LATENCY_MAX
+};
+
+struct latency_counters {
+	volatile u_int32_t	 lc_buckets[LATENCY_MAX][RELAY_HISTBUCKETS];
+	volatile u_int64_t	 lc_sum[LATENCY_MAX];
+};
+
+#define LATENCY_NPCT		4	/* p50, p90, p99, p99.9 */
+
+struct ctl_latency {
+	objid_t			 id;
+	int			 host;
+	u_int64_t		 cnt[LATENCY_MAX];
+	u_int32_t		 pct[LATENCY_MAX][LATENCY_NPCT];
+};
+
+struct ssl_cacheslot {
+	volatile u_int		 cs_lock;
+	u_int			 cs_idlen;
+	u_int8_t		 cs_id[RELAY_SSLCACHE_IDLEN];
+	size_t			 cs_len;
+	u_int8_t		 cs_data[RELAY_SSLCACHE_SESSLEN];
+};
+
 struct ca_pkey {
 	objid_t			 pkey_id;
 	EVP_PKEY		*pkey;
@@ -752,6 +965,11 @@ struct relay_config {
 	struct sockaddr_storage	 dstss;
 	struct sockaddr_storage	 dstaf;
 	struct timeval		 timeout;
+	u_int			 maxsessions;
+	u_int			 keepalive;
+	struct timeval		 keepalive_timeout;
+	size_t			 bufhigh;
+	size_t			 buflow;
 	enum forwardmode	 fwdmode;
 	off_t			 ssl_cert_len;
 	off_t			 ssl_key_len;
@@ -762,6 +980,18 @@ struct relay_config {
 	objid_t			 ssl_cakeyid;
 };
 
+/* Idle backend connection that can be reused by another session */
+struct relay_backend {
+	TAILQ_ENTRY(relay_backend)	 rb_entry;
+	struct relay			*rb_relay;
+	struct sockaddr_storage		 rb_ss;
+	in_port_t			 rb_port;
+	int				 rb_s;
+	SSL				*rb_ssl;
+	struct event			 rb_ev;
+};
+TAILQ_HEAD(relay_backends, relay_backend);
+
 struct relay {
 	TAILQ_ENTRY(relay)	 rl_entry;
 	struct relay_config	 rl_conf;
@@ -796,8 +1026,13 @@ struct relay {
 	EVP_PKEY		*rl_ssl_capkey;
 
 	struct ctl_stats	 rl_stats[RELAY_MAXPROC + 1];
+	struct relay_counters	*rl_counters;
+	struct latency_counters	*rl_latency;
+
+	struct sessionlist	 rl_sessions;
+	u_int			 rl_nsessions;
 
-	struct session_tree	 rl_sessions;
+	struct relay_backends	 rl_backends;
 };
 TAILQ_HEAD(relaylist, relay);
 
@@ -807,7 +1042,8 @@ enum dstmode {
 	RELAY_DSTMODE_HASH,
 	RELAY_DSTMODE_SRCHASH,
 	RELAY_DSTMODE_LEASTSTATES,
-	RELAY_DSTMODE_RANDOM
+	RELAY_DSTMODE_RANDOM,
+	RELAY_DSTMODE_LEASTLATENCY
 };
 #define RELAY_DSTMODE_DEFAULT		RELAY_DSTMODE_ROUNDROBIN
 
@@ -934,6 +1170,7 @@ enum imsg_type {
 	IMSG_CTL_TABLE_DISABLE,
 	IMSG_CTL_HOST_ENABLE,
 	IMSG_CTL_HOST_DISABLE,
+	IMSG_CTL_HOST_WEIGHT,
 	IMSG_CTL_SHUTDOWN,
 	IMSG_CTL_START,
 	IMSG_CTL_RELOAD,
@@ -942,19 +1179,23 @@ enum imsg_type {
 	IMSG_CTL_NOTIFY,
 	IMSG_CTL_RDR_STATS,
 	IMSG_CTL_RELAY_STATS,
+	IMSG_CTL_LATENCY,
+	IMSG_CTL_METRICS,
 	IMSG_RDR_ENABLE,	/* notifies from pfe to hce */
 	IMSG_RDR_DISABLE,
 	IMSG_TABLE_ENABLE,
 	IMSG_TABLE_DISABLE,
 	IMSG_HOST_ENABLE,
 	IMSG_HOST_DISABLE,
+	IMSG_HOST_WEIGHT,
 	IMSG_HOST_STATUS,	/* notifies from hce to pfe */
+	IMSG_HOST_EJECT,	/* passive checks, relay to pfe to relay */
+	IMSG_HOST_READMIT,
 	IMSG_SYNC,
 	IMSG_NATLOOK,
 #ifndef __FreeBSD__
 	IMSG_DEMOTE,
 #endif
-	IMSG_STATISTICS,
 	IMSG_SCRIPT,
 #ifndef __FreeBSD__
 	IMSG_SNMPSOCK,
@@ -1071,6 +1312,14 @@ struct relayd {
 #endif
 	struct ca_pkeylist	*sc_pkeys;
 	u_int16_t		 sc_prefork_relay;
+	u_int			 sc_maxsessions;
+	u_int			 sc_hostslots;
+	u_int			 sc_relayslots;
+	struct host_counters	*sc_hoststats;
+	struct relay_counters	*sc_relaystats;
+	struct latency_counters	*sc_relaylatency;
+	struct latency_counters	*sc_hostlatency;
+	struct ssl_cacheslot	*sc_sslcache;
 	char			 sc_demote_group[IFNAMSIZ];
 	u_int16_t		 sc_id;
 
@@ -1134,12 +1383,16 @@ void	 getmonotime(struct timeval *);
 pid_t	 pfe(struct privsep *, struct privsep_proc *);
 void	 show(struct ctl_conn *);
 void	 show_sessions(struct ctl_conn *);
+void	 show_metrics(struct ctl_conn *);
 int	 enable_rdr(struct ctl_conn *, struct ctl_id *);
 int	 enable_table(struct ctl_conn *, struct ctl_id *);
 int	 enable_host(struct ctl_conn *, struct ctl_id *, struct host *);
 int	 disable_rdr(struct ctl_conn *, struct ctl_id *);
 int	 disable_table(struct ctl_conn *, struct ctl_id *);
 int	 disable_host(struct ctl_conn *, struct ctl_id *, struct host *);
+int	 weight_host(struct ctl_conn *, struct ctl_weight *);
+void	 eject_host(struct host *);
+void	 readmit_host(struct host *);
 
 /* pfe_filter.c */
 void	 init_filter(struct relayd *, int);
@@ -1164,10 +1417,16 @@ pid_t	 hce(struct privsep *, struct privsep_proc *);
 void	 hce_notify_done(struct host *, enum host_error);
 
 /* relay.c */
+extern struct pool relay_session_pool;
 pid_t	 relay(struct privsep *, struct privsep_proc *);
 int	 relay_privinit(struct relay *);
+int	 relay_privinit_shard(struct relay *);
+int	 relay_session_full(struct relay *);
+void	 relay_table_update(struct table *, struct host *, int);
+void	 relay_host_sample(struct ctl_relay_event *);
+void	 relay_host_outlier(struct rsession *, int);
+void	 relay_accept_pause(struct relay *);
 void	 relay_notify_done(struct host *, const char *);
-int	 relay_session_cmp(struct rsession *, struct rsession *);
 int	 relay_load_certfiles(struct relay *);
 void	 relay_close(struct rsession *, const char *);
 void	 relay_natlook(int, short, void *);
@@ -1182,12 +1441,23 @@ int	 relay_cmp_af(struct sockaddr_storage *,
 	    struct sockaddr_storage *);
 void	 relay_write(struct bufferevent *, void *);
 void	 relay_read(struct bufferevent *, void *);
+#ifdef RELAY_SPLICE
 int	 relay_splice(struct ctl_relay_event *);
 int	 relay_splicelen(struct ctl_relay_event *);
 int	 relay_spliceadjust(struct ctl_relay_event *);
+#endif
+#ifdef RELAY_SPLICE_PIPE
+void	 relay_splice_close(struct ctl_relay_event *);
+#endif
 void	 relay_error(struct bufferevent *, short, void *);
 int	 relay_preconnect(struct rsession *);
 int	 relay_connect(struct rsession *);
+void	 relay_timer_add(struct rsession *);
+void	 relay_timer_del(struct rsession *);
+int	 relay_backend_get(struct rsession *);
+int	 relay_backend_put(struct rsession *);
+int	 relay_backend_release(struct rsession *);
+void	 relay_backend_purge(struct relay *);
 void	 relay_connected(int, short, void *);
 void	 relay_bindanyreq(struct rsession *, in_port_t, int);
 void	 relay_bindany(int, short, void *);
@@ -1198,6 +1468,7 @@ int	 relay_bufferevent_write_buffer(struct ctl_relay_event *,
 	    struct evbuffer *);
 int	 relay_bufferevent_write_chunk(struct ctl_relay_event *,
 	    struct evbuffer *, size_t);
+int	 relay_bufferevent_pressure(struct ctl_relay_event *);
 int	 relay_bufferevent_write(struct ctl_relay_event *,
 	    void *, size_t);
 int	 relay_test(struct protocol *, struct ctl_relay_event *);
@@ -1205,15 +1476,16 @@ void	 relay_calc_skip_steps(struct relay_rules *);
 void	 relay_match(struct kvlist *, struct kv *, struct kv *,
 	    struct kvtree *);
 
-SPLAY_PROTOTYPE(session_tree, rsession, se_nodes, relay_session_cmp);
 
 /* relay_http.c */
+extern struct pool relay_httpdesc_pool;
 void	 relay_http(struct relayd *);
 void	 relay_http_init(struct relay *);
 void	 relay_abort_http(struct rsession *, u_int, const char *,
 	    u_int16_t);
 void	 relay_read_http(struct bufferevent *, void *);
 void	 relay_close_http(struct rsession *);
+int	 relay_http_reusable(struct rsession *);
 u_int	 relay_httpmethod_byname(const char *);
 const char
 	*relay_httpmethod_byid(u_int);
@@ -1275,6 +1547,9 @@ void		 event_again(struct event *, int, short,
 struct relay	*relay_find(struct relayd *, objid_t);
 struct protocol	*proto_find(struct relayd *, objid_t);
 struct rsession	*session_find(struct relayd *, objid_t);
+struct rsession	*session_findbykey(struct relay *, u_int32_t);
+void		 session_insert(struct relay *, struct rsession *);
+void		 session_remove(struct relay *, struct rsession *);
 struct relay	*relay_findbyname(struct relayd *, const char *);
 struct relay	*relay_findbyaddr(struct relayd *, struct relay_config *);
 EVP_PKEY	*pkey_find(struct relayd *, objid_t);
@@ -1291,7 +1566,26 @@ int		 map4to6(struct sockaddr_storage *, struct sockaddr_storage *);
 void		 imsg_event_add(struct imsgev *);
 int		 imsg_compose_event(struct imsgev *, u_int16_t, u_int32_t,
 		    pid_t, int, void *, u_int16_t);
-void		 socket_rlimit(int);
+int		 socket_rlimit(int);
+void		*shared_calloc(size_t, size_t);
+void		 shared_free(void *, size_t, size_t);
+void		 sslcache_unmap(struct relayd *);
+struct relay_counters
+		*relay_counters(struct relayd *, objid_t, int);
+struct host_counters
+		*host_counters(struct relayd *, objid_t);
+void		 stat_slots(struct relayd *);
+void		 stat_reset(struct relayd *);
+void		 stat_session(struct relay_counters *, time_t);
+void		 stat_relay(struct relay_counters *, struct ctl_stats *);
+struct latency_counters
+		*latency_relay(struct relayd *, objid_t);
+struct latency_counters
+		*latency_host(struct relayd *, objid_t);
+void		 latency_add(struct latency_counters *, enum latency_type,
+		    struct timeval *);
+int		 latency_get(struct latency_counters *, struct ctl_latency *);
+u_int32_t	 latency_value(u_int);
 char		*get_string(u_int8_t *, size_t);
 void		*get_data(u_int8_t *, size_t);
 int		 sockaddr_cmp(struct sockaddr *, struct sockaddr *, int);
@@ -1352,6 +1646,18 @@ void	 snmp_hosttrap(struct relayd *, struct table *, struct host *);
 void		shuffle_init(struct shuffle *);
 u_int16_t	shuffle_generate16(struct shuffle *);
 
+/* pool.c */
+extern struct pool evbuffer_pool;
+void		 pool_init(struct pool *, const char *, size_t, u_int);
+void		 pool_destroy(struct pool *);
+void		*pool_get(struct pool *);
+void		 pool_put(struct pool *, void *);
+struct evbuffer	*pool_evbuffer_get(void);
+void		 pool_evbuffer_put(struct evbuffer *);
+void		 pool_evbuffer_destroy(void);
+void		 pool_bufferevent_free(struct bufferevent *);
+void		 pool_debug(struct pool *);
+
 /* log.c */
 void	log_init(int);
 void	log_verbose(int);